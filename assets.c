@@ -0,0 +1,204 @@
+/*
+ * assets.c - files of web-interface served from memory: gzipped variants &
+ *            answers with all headers are prepared at start
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "assets.h"
+
+#define ETAGLEN  (32)
+
+// one representation: plain or gzipped
+typedef struct{
+	unsigned char *data;   // answer 200 with headers
+	size_t len;
+	char etag[ETAGLEN];    // strong ETag (quoted)
+} variant;
+
+typedef struct{
+	const char *uri;
+	const char *file;
+	const char *type;
+	variant plain, gz;     // gz.data == NULL if compression is useless
+} asset;
+
+static asset assets[] = {
+	{"/", ASSETS_INDEX, "text/html; charset=utf-8", {NULL, 0, ""}, {NULL, 0, ""}},
+	{"/" ASSETS_INDEX, ASSETS_INDEX, "text/html; charset=utf-8", {NULL, 0, ""}, {NULL, 0, ""}},
+};
+#define NASSETS  (sizeof(assets) / sizeof(assets[0]))
+
+static uint64_t fnv1a(const unsigned char *d, size_t L){
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while(L--){
+		h ^= *d++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static unsigned char *read_file(const char *dir, const char *name, size_t *len){
+	char path[4096];
+	unsigned char *d;
+	long L;
+	FILE *f;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if(!(f = fopen(path, "r"))){
+		perror(path);
+		return NULL;
+	}
+	if(fseek(f, 0, SEEK_END) || (L = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)){
+		fclose(f);
+		return NULL;
+	}
+	if((d = malloc(L + 1)) && fread(d, 1, L, f) != (size_t)L){
+		free(d);
+		d = NULL;
+	}
+	fclose(f);
+	*len = (size_t)L;
+	return d;
+}
+
+/**
+ * Compress data by gzip
+ * @return compressed data or NULL if it isn't smaller than original
+ */
+static unsigned char *gzip(const unsigned char *d, size_t L, size_t *gzlen){
+	z_stream z;
+	unsigned char *out;
+	size_t sz = L; // no sense to keep bigger
+	memset(&z, 0, sizeof(z));
+	if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+	if(!(out = malloc(sz))){
+		deflateEnd(&z);
+		return NULL;
+	}
+	z.next_in = (unsigned char*)d;
+	z.avail_in = L;
+	z.next_out = out;
+	z.avail_out = sz;
+	if(deflate(&z, Z_FINISH) != Z_STREAM_END){
+		free(out);
+		out = NULL;
+	}
+	*gzlen = z.total_out;
+	deflateEnd(&z);
+	return out;
+}
+
+/**
+ * Make answer 200 with body
+ */
+static int make_variant(variant *v, const asset *a, const unsigned char *body, size_t L,
+			uint64_t hash, int gz){
+	char hdr[512];
+	size_t H;
+	snprintf(v->etag, ETAGLEN, "\"%016llx%s\"", (unsigned long long)hash, gz ? "-gz" : "");
+	H = (size_t)snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+		"Content-Length: %zu\r\n%sETag: %s\r\nCache-Control: no-cache\r\n"
+		"Vary: Accept-Encoding\r\nConnection: close\r\n\r\n", a->type, L,
+		gz ? "Content-Encoding: gzip\r\n" : "", v->etag);
+	if(!(v->data = malloc(H + L))) return 1;
+	memcpy(v->data, hdr, H);
+	memcpy(v->data + H, body, L);
+	v->len = H + L;
+	return 0;
+}
+
+/**
+ * Read all files of web-interface & prepare answers
+ * @param dir - directory with files
+ * @return amount of files that can't be loaded
+ */
+int assets_load(const char *dir){
+	size_t i, j, L, gzlen = 0;
+	int bad = 0;
+	for(i = 0; i < NASSETS; ++i){
+		asset *a = &assets[i];
+		unsigned char *d, *z;
+		uint64_t h;
+		for(j = 0; j < i; ++j) // the same file by other URI
+			if(!strcmp(assets[j].file, a->file) && assets[j].plain.data) break;
+		if(j < i){
+			a->plain = assets[j].plain;
+			a->gz = assets[j].gz;
+			continue;
+		}
+		if(!(d = read_file(dir, a->file, &L))){
+			++bad;
+			continue;
+		}
+		h = fnv1a(d, L);
+		if(make_variant(&a->plain, a, d, L, h, 0)) ++bad;
+		if((z = gzip(d, L, &gzlen))){
+			make_variant(&a->gz, a, z, gzlen, h, 1);
+			free(z);
+		}
+		free(d);
+	}
+	return bad;
+}
+
+/**
+ * Client accepts gzip (and it isn't forbidden by "q=0")
+ */
+static int accepts_gzip(const char *ae){
+	const char *p;
+	if(!ae || !(p = strstr(ae, "gzip"))) return 0;
+	p += 4;
+	while(*p == ' ') ++p;
+	return strncmp(p, ";q=0", 4) || p[4] == '.';
+}
+
+/**
+ * Find answer to request of file
+ * @param uri             - requested URI
+ * @param if_none_match   - content of "If-None-Match" header or NULL
+ * @param accept_encoding - content of "Accept-Encoding" header or NULL
+ * @param r               - answer (data point to inner storage or to buf)
+ * @param buf, buflen     - buffer for answer 304
+ * @return 0 if found, 1 if there's no such file
+ */
+int assets_reply(const char *uri, const char *if_none_match, const char *accept_encoding,
+		asset_reply *r, char *buf, size_t buflen){
+	size_t i, L = strcspn(uri, "?");
+	variant *v;
+	for(i = 0; i < NASSETS; ++i)
+		if(!strncmp(assets[i].uri, uri, L) && !assets[i].uri[L]) break;
+	if(i == NASSETS || !assets[i].plain.data) return 1;
+	v = (assets[i].gz.data && accepts_gzip(accept_encoding)) ? &assets[i].gz : &assets[i].plain;
+	if(if_none_match && (strstr(if_none_match, v->etag) || !strcmp(if_none_match, "*"))){
+		r->len = (size_t)snprintf(buf, buflen, "HTTP/1.0 304 Not Modified\r\nETag: %s\r\n"
+			"Cache-Control: no-cache\r\nVary: Accept-Encoding\r\nConnection: close\r\n\r\n", v->etag);
+		r->data = (unsigned char*)buf;
+		r->status = 304;
+		return 0;
+	}
+	r->data = v->data;
+	r->len = v->len;
+	r->status = 200;
+	return 0;
+}
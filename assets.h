@@ -0,0 +1,52 @@
+/*
+ * assets.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __ASSETS_H__
+#define __ASSETS_H__
+
+#include <stddef.h>
+
+// directory with files of web-interface
+#ifndef ASSETS_DIR
+	#ifdef CUR_PATH
+		#define ASSETS_DIR  CUR_PATH
+	#else
+		#define ASSETS_DIR  "."
+	#endif
+#endif
+
+// main page of web-interface (other model has test1.html)
+#ifndef ASSETS_INDEX
+	#define ASSETS_INDEX  "test.html"
+#endif
+
+// answer to HTTP request
+typedef struct{
+	const unsigned char *data; // headers & body
+	size_t len;
+	int status;                // 200 or 304
+} asset_reply;
+
+int assets_load(const char *dir);
+int assets_reply(const char *uri, const char *if_none_match, const char *accept_encoding,
+		asset_reply *r, char *buf, size_t buflen);
+
+#endif // __ASSETS_H__
@@ -0,0 +1,192 @@
+/*
+ * bench.c - microbenchmarks of hot paths: queue of messages, parsing &
+ *           dispatch of commands, header of frames & base64 encoder
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+// main.c is included to reach its queues & parser without websockets
+#define main websock_main
+#include "main.c"
+#undef main
+
+// time of one measurement (ns) & amount of measurements (the best one is shown)
+#define BENCH_TIME  (50000000LL)
+#define BENCH_RUNS  (5)
+
+// allocations are counted by wrappers of glibc allocator
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long nallocs = 0;
+
+void *malloc(size_t size){
+	++nallocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size){
+	++nallocs;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size){
+	++nallocs;
+	return __libc_realloc(ptr, size);
+}
+
+typedef struct{
+	const char *name;
+	size_t size;              // payload size for report
+	int mbps;                 // show throughput
+	void (*fn)(void *arg);    // one operation
+	void *arg;
+} bench;
+
+static volatile size_t sink; // results shouldn't be thrown away by compiler
+
+static int64_t now_ns(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * Run operation enough times & print the best time of it
+ */
+static void run(const bench *b){
+	uint64_t n = 1, i;
+	int64_t t0, t = 0, best = 0;
+	unsigned long a0, allocs;
+	int r;
+	// amount of operations for BENCH_TIME
+	while(1){
+		t0 = now_ns();
+		for(i = 0; i < n; ++i) b->fn(b->arg);
+		t = now_ns() - t0;
+		if(t >= BENCH_TIME / 4 || n >= (1ULL << 40)) break;
+		n *= 2;
+	}
+	if(t < BENCH_TIME) n = (uint64_t)((double)n * BENCH_TIME / (t ? t : 1)) + 1;
+	a0 = nallocs;
+	for(r = 0; r < BENCH_RUNS; ++r){
+		t0 = now_ns();
+		for(i = 0; i < n; ++i) b->fn(b->arg);
+		t = now_ns() - t0;
+		if(!r || t < best) best = t;
+	}
+	allocs = nallocs - a0;
+	printf("%-36s %8zu %12.1f %10.2f", b->name, b->size, (double)best / n,
+		(double)allocs / (n * BENCH_RUNS));
+	if(b->mbps) printf(" %10.1f", b->size * 1e3 / ((double)best / n));
+	printf("\n");
+}
+
+// queue of messages: put & get
+static per_session_data queue;
+
+static void queue_op(void *arg){
+	put_message_to_queue((char*)arg, &queue);
+	sink += (size_t)get_message_from_queue(&queue);
+}
+
+// full queue: message is dropped
+static void queue_full_op(void *arg){
+	put_message_to_queue((char*)arg, &queue);
+}
+
+// command from client: check, execute & read answers
+static void command_op(void *arg){
+	char cmd[CMDBUFLEN];
+	char *M;
+	strcpy(cmd, (const char*)arg); // parser can change command
+	websig(cmd, &queue);
+	while((M = get_message_from_queue(&global_queue))) sink += (size_t)*M;
+	while((M = get_message_from_queue(&queue))) sink += (size_t)*M;
+}
+
+// header of frame from image server
+static void getsz_op(void *arg){
+	size_t L;
+	sink += (size_t)getsz((imbuf*)arg, &L) + L;
+}
+
+typedef struct{
+	unsigned char *data;
+	size_t len;
+} payload;
+
+static void base64_op(void *arg){
+	payload *p = (payload*)arg;
+	size_t L;
+	unsigned char *b = base64_encode(p->data, p->len, &L);
+	sink += b[L - 1];
+	free(b);
+}
+
+// frame from image server: "jpg\n<len>\n<data>"
+static imbuf make_frame(size_t len){
+	imbuf buf;
+	char hdr[32];
+	size_t H = (size_t)snprintf(hdr, 32, "%s\n%zu\n", IMAGE_FORMAT, len);
+	buf.data = __libc_malloc(H + len + 1);
+	memcpy(buf.data, hdr, H);
+	memset(buf.data + H, 0x5a, len);
+	buf.data[H + len] = 0;
+	buf.len = H + len;
+	return buf;
+}
+
+int main(_U_ int argc, _U_ char **argv){
+	static const size_t sizes[] = {64, 1024, 65536, 1048576};
+	static char msgs[3][MESSAGE_LEN];
+	static const size_t msglen[3] = {8, 32, MESSAGE_LEN - 1};
+	static const char *commands[] = {"G", "R", "Q", "T", "PX", "JX", "S150", "PX800,800,400,t", "Z"};
+	const int ncmd = sizeof(commands) / sizeof(commands[0]), nsz = sizeof(sizes) / sizeof(sizes[0]);
+	imbuf frames[4];
+	payload pl[4];
+	char names[16][48];
+	int i;
+
+	gpio_simulate = 1; // motors are set up but never run
+	setup_motors();
+	trace_open("/tmp/rasp-spect-bench.trace", 0);
+	trace_thread("bench");
+	printf("%-36s %8s %12s %10s %10s\n", "benchmark", "bytes", "ns/op", "allocs/op", "MB/s");
+	for(i = 0; i < 3; ++i){
+		memset(msgs[i], 'a', msglen[i]);
+		run(&(bench){"queue put+get", msglen[i], 0, queue_op, msgs[i]});
+	}
+	for(i = 0; i < MESSAGE_QUEUE_SIZE; ++i) put_message_to_queue(msgs[0], &queue);
+	run(&(bench){"queue put (full, dropped)", msglen[0], 0, queue_full_op, msgs[0]});
+	memset(&queue, 0, sizeof(queue));
+	for(i = 0; i < ncmd; ++i){
+		snprintf(names[i], 48, "websig+process_buf \"%s\"", commands[i]);
+		run(&(bench){names[i], strlen(commands[i]), 0, command_op, (void*)commands[i]});
+	}
+	for(i = 0; i < nsz; ++i){
+		frames[i] = make_frame(sizes[i]);
+		run(&(bench){"getsz", sizes[i], 0, getsz_op, &frames[i]});
+	}
+	for(i = 0; i < nsz; ++i){
+		pl[i].data = frames[i].data;
+		pl[i].len = sizes[i];
+		run(&(bench){"base64_encode", sizes[i], 1, base64_op, &pl[i]});
+	}
+	return 0;
+}
@@ -0,0 +1,337 @@
+/*
+ * gpio.c - access to GPIO pins (BCM numbering) through /dev/gpiomem
+ *          or (if it isn't available) through wiringPi;
+ *          on PC (or by request) GPIO is simulated
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __arm__
+	#include <wiringPi.h>
+#endif
+
+#include "gpio.h"
+#include "rtsched.h"
+
+#ifdef __arm__
+int gpio_simulate = 0;
+#else
+int gpio_simulate = 1; // there's no GPIO on PC
+#endif
+
+#define GPIOMEM      "/dev/gpiomem"
+#define BLOCK_SIZE   (4096)
+// registers (32-bit words offsets)
+#define GPFSEL0      (0x00/4)
+#define GPSET0       (0x1C/4)
+#define GPCLR0       (0x28/4)
+#define GPLEV0       (0x34/4)
+#define GPPUD        (0x94/4)
+#define GPPUDCLK0    (0x98/4)
+
+static volatile uint32_t *gpio = NULL; // mapped registers or NULL for wiringPi
+static uint32_t outputs = 0; // mask of output pins
+static uint32_t used = 0;    // mask of all configured pins
+
+// watched input pins
+typedef struct{
+	gpio_edge_handler handler;
+	void *arg;
+	int64_t debounce;   // ns
+	int64_t changed;    // time of last raw edge
+	int level;          // debounced level
+	int fd;             // sysfs file of pin value (hardware only)
+} edge_watch;
+static edge_watch watches[32];
+static uint32_t watched = 0; // mask of watched pins
+static uint32_t pending = 0; // pins with raw level differs from debounced
+static pthread_mutex_t edge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void edges(uint32_t changed);
+
+/**
+ * Map GPIO registers; if there's no /dev/gpiomem, init wiringPi
+ * @return 0 if all OK
+ */
+int gpio_setup(){
+	if(gpio_simulate) return sim_setup();
+#ifdef __arm__
+	int fd = open(GPIOMEM, O_RDWR | O_SYNC);
+	if(fd > -1){
+		void *map = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map != MAP_FAILED){
+			gpio = (volatile uint32_t *)map;
+			return 0;
+		}
+		perror("mmap()");
+	}else perror("open(" GPIOMEM ")");
+	fprintf(stderr, "Use wiringPi for GPIO\n");
+	return wiringPiSetupGpio() < 0;
+#else
+	return 1;
+#endif
+}
+
+const char *gpio_backend(){
+	if(gpio_simulate) return "simulation";
+	return gpio ? "gpiomem" : "wiringPi";
+}
+
+void gpio_mode(int pin, int mode){
+	used |= PINMASK(pin);
+	if(mode == GPIO_OUT) outputs |= PINMASK(pin);
+	else outputs &= ~PINMASK(pin);
+	if(gpio_simulate) return;
+#ifdef __arm__
+	if(!gpio){
+		pinMode(pin, (mode == GPIO_OUT) ? OUTPUT : INPUT);
+		return;
+	}
+	volatile uint32_t *reg = gpio + GPFSEL0 + pin / 10;
+	int shift = (pin % 10) * 3;
+	*reg = (*reg & ~(7U << shift)) | ((mode == GPIO_OUT ? 1U : 0U) << shift);
+#endif
+}
+
+/**
+ * Turn on pull-up resistor of input pin (e.g. for switches shorting it to ground)
+ */
+void gpio_pullup(int pin){
+	if(gpio_simulate) return;
+#ifdef __arm__
+	if(!gpio){
+		pullUpDnControl(pin, PUD_UP);
+		return;
+	}
+	// BCM2835 sequence: control signal, clock it into pin, remove both
+	gpio[GPPUD] = 2;
+	usleep(10);
+	gpio[GPPUDCLK0] = PINMASK(pin);
+	usleep(10);
+	gpio[GPPUD] = 0;
+	gpio[GPPUDCLK0] = 0;
+#else
+	(void) pin;
+#endif
+}
+
+/**
+ * Set output pins from `set` to 1 & from `clr` to 0 by single register writes
+ * and wait until levels are changed
+ */
+void gpio_write_mask(uint32_t set, uint32_t clr){
+	uint32_t mask = (set | clr) & outputs;
+	if(gpio_simulate){ // simulated end-switches change when motors move
+		uint32_t changed = sim_write_mask(set, clr, outputs) & watched;
+		if(changed || __atomic_load_n(&pending, __ATOMIC_RELAXED)) edges(changed);
+		return;
+	}
+#ifdef __arm__
+	if(!gpio){
+		int pin;
+		for(pin = 0; pin < 32; ++pin){
+			if(!(mask & PINMASK(pin))) continue;
+			int val = (set & PINMASK(pin)) ? 1 : 0;
+			digitalWrite(pin, val);
+			while(digitalRead(pin) != val);
+		}
+		return;
+	}
+	if(set) gpio[GPSET0] = set;
+	if(clr) gpio[GPCLR0] = clr;
+	while((gpio[GPLEV0] & mask) != (set & mask));
+#else
+	(void) mask;
+#endif
+}
+
+void gpio_write(int pin, int val){
+	if(val) gpio_write_mask(PINMASK(pin), 0);
+	else gpio_write_mask(0, PINMASK(pin));
+}
+
+/**
+ * @return levels of all pins 0..31 (bit N - pin N)
+ */
+uint32_t gpio_read_all(){
+	if(gpio_simulate) return sim_read_all();
+#ifdef __arm__
+	if(!gpio){
+		uint32_t lev = 0;
+		int pin;
+		for(pin = 0; pin < 32; ++pin) // read only configured pins
+			if((used & PINMASK(pin)) && digitalRead(pin)) lev |= PINMASK(pin);
+		return lev;
+	}
+	return gpio[GPLEV0];
+#else
+	return 0;
+#endif
+}
+
+int gpio_read(int pin){
+#ifdef __arm__
+	if(!gpio_simulate && !gpio) return digitalRead(pin);
+#endif
+	return (gpio_read_all() & PINMASK(pin)) ? 1 : 0;
+}
+
+static int64_t nsnow(){
+	struct timespec ts;
+	clock_now(&ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Raw edges of pins & debouncing (should be called with edge_mutex locked)
+ * @param changed - mask of pins changed their levels
+ * @param lev     - current levels of pins
+ * @param t       - current time
+ */
+static void debounce(uint32_t changed, uint32_t lev, int64_t t){
+	int pin;
+	for(pin = 0; pin < 32; ++pin){
+		edge_watch *w = &watches[pin];
+		if(changed & PINMASK(pin)){ // bounce restarts waiting
+			w->changed = t;
+			if((int)((lev >> pin) & 1) != w->level) pending |= PINMASK(pin);
+			else pending &= ~PINMASK(pin);
+		}
+		if(!(pending & PINMASK(pin)) || t - w->changed < w->debounce) continue;
+		pending &= ~PINMASK(pin);
+		w->level = !w->level;
+		w->handler(pin, w->level, w->arg);
+	}
+}
+
+/**
+ * Process changes of simulated inputs
+ */
+static void edges(uint32_t changed){
+	pthread_mutex_lock(&edge_mutex);
+	debounce(changed, sim_read_all(), nsnow());
+	pthread_mutex_unlock(&edge_mutex);
+}
+
+#ifdef __arm__
+/**
+ * Turn on interrupts by both edges of pin through sysfs
+ * @return file descriptor of pin value or -1
+ */
+static int sysfs_edge(int pin){
+	char path[64], c;
+	FILE *f;
+	int fd;
+	snprintf(path, 64, "/sys/class/gpio/gpio%d/value", pin);
+	if(access(path, F_OK)){
+		if(!(f = fopen("/sys/class/gpio/export", "w"))){
+			perror("/sys/class/gpio/export");
+			return -1;
+		}
+		fprintf(f, "%d", pin);
+		fclose(f);
+	}
+	snprintf(path, 64, "/sys/class/gpio/gpio%d/edge", pin);
+	if(!(f = fopen(path, "w"))){
+		perror(path);
+		return -1;
+	}
+	fprintf(f, "both");
+	fclose(f);
+	snprintf(path, 64, "/sys/class/gpio/gpio%d/value", pin);
+	if((fd = open(path, O_RDONLY)) < 0) perror(path);
+	else if(read(fd, &c, 1) < 0) perror("read()"); // clear old event
+	return fd;
+}
+
+/**
+ * Wait for edges of watched pins; when some pin is pending, wake up at the
+ * end of its debounce time
+ */
+static void *edge_thread(void *arg){
+	struct pollfd fds[32];
+	int pins[32], n, i, pin, tmout;
+	char c;
+	(void) arg;
+	while(1){
+		uint32_t w = __atomic_load_n(&watched, __ATOMIC_ACQUIRE), changed = 0, lev = 0;
+		int64_t t = nsnow();
+		tmout = 100; // look for new watched pins sometimes
+		pthread_mutex_lock(&edge_mutex);
+		for(n = 0, pin = 0; pin < 32; ++pin){
+			if(!(w & PINMASK(pin))) continue;
+			fds[n].fd = watches[pin].fd;
+			fds[n].events = POLLPRI | POLLERR;
+			pins[n++] = pin;
+			if(pending & PINMASK(pin)){
+				int64_t ms = (watches[pin].changed + watches[pin].debounce - t + 999999) / 1000000;
+				if(ms < tmout) tmout = (ms > 0) ? (int)ms : 0;
+			}
+		}
+		pthread_mutex_unlock(&edge_mutex);
+		if(poll(fds, n, tmout) < 0) continue;
+		for(i = 0; i < n; ++i){
+			if(!(fds[i].revents & (POLLPRI | POLLERR))) continue;
+			if(lseek(fds[i].fd, 0, SEEK_SET) || read(fds[i].fd, &c, 1) != 1) continue;
+			changed |= PINMASK(pins[i]);
+			if(c == '1') lev |= PINMASK(pins[i]);
+		}
+		pthread_mutex_lock(&edge_mutex);
+		debounce(changed, lev, nsnow());
+		pthread_mutex_unlock(&edge_mutex);
+	}
+	return NULL;
+}
+#endif
+
+/**
+ * Call handler on edges of input pin
+ * @param debounce_us - time (us) pin should hold new level before handler is called
+ * @return 0 if all OK
+ */
+int gpio_watch(int pin, unsigned int debounce_us, gpio_edge_handler h, void *arg){
+	edge_watch *w;
+	if(pin < 0 || pin > 31 || !h || (watched & PINMASK(pin))) return 1;
+	w = &watches[pin];
+	w->fd = -1;
+#ifdef __arm__
+	static pthread_t thread;
+	if(!gpio_simulate){
+		if((w->fd = sysfs_edge(pin)) < 0) return 1;
+		if(!watched && pthread_create(&thread, NULL, edge_thread, NULL)){
+			perror("pthread_create()");
+			close(w->fd);
+			return 1;
+		}
+	}
+#endif
+	pthread_mutex_lock(&edge_mutex);
+	w->handler = h;
+	w->arg = arg;
+	w->debounce = (int64_t)debounce_us * 1000;
+	w->changed = nsnow();
+	w->level = gpio_read(pin);
+	__atomic_or_fetch(&watched, PINMASK(pin), __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&edge_mutex);
+	return 0;
+}
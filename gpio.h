@@ -0,0 +1,80 @@
+/*
+ * gpio.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __GPIO_H__
+#define __GPIO_H__
+
+#include <stdint.h>
+
+// mask of BCM GPIO pin for gpio_write_mask()
+#define PINMASK(pin)  (1U << (pin))
+
+#define GPIO_IN    (0)
+#define GPIO_OUT   (1)
+
+extern int gpio_simulate;
+
+int gpio_setup();
+const char *gpio_backend();
+void gpio_mode(int pin, int mode);
+void gpio_pullup(int pin);
+void gpio_write(int pin, int val);
+int gpio_read(int pin);
+void gpio_write_mask(uint32_t set, uint32_t clr);
+uint32_t gpio_read_all();
+
+/*
+ * Edge events of input pins: handler gets debounced level (it changes only
+ * after pin holds new level for debounce time); handler is called from
+ * edge thread (or from thread writing GPIO when simulating), so it shouldn't
+ * use GPIO itself
+ */
+typedef void (*gpio_edge_handler)(int pin, int level, void *arg);
+int gpio_watch(int pin, unsigned int debounce_us, gpio_edge_handler h, void *arg);
+
+/*
+ * Simulated hardware (used on PC or with gpio_simulate set)
+ */
+// types of simulated motors
+#define SIM_STEPDIR  (0)    // driver with EN, DIR & CLK inputs
+#define SIM_PHASES   (1)    // 4-wire motor driven by coils A+, A-, B+, B-
+
+typedef struct{
+	int type;           // SIM_STEPDIR or SIM_PHASES
+	int pins[4];        // SIM_STEPDIR: EN, DIR, CLK; SIM_PHASES: A+, A-, B+, B-
+	long pos;           // position (CLK pulses or half-steps)
+	long min, max;      // mechanical limits of moving
+	int esw[2];         // end-switches (active low) at min & max side, -1 - none
+	long eswpos[2];     // they're pressed when pos <= eswpos[0] or pos >= eswpos[1]
+	double maxrate;     // max pulses per second, motor stalls if faster (0 - no limit)
+	unsigned long lost; // pulses lost on mechanical limits or stall
+	// internal state
+	int phase;
+	int64_t lastmove;
+} sim_motor;
+
+int sim_setup();
+int sim_add_motor(const sim_motor *m);
+int sim_get_motor(int n, sim_motor *m);
+uint32_t sim_write_mask(uint32_t set, uint32_t clr, uint32_t outputs);
+uint32_t sim_read_all();
+
+#endif // __GPIO_H__
@@ -0,0 +1,164 @@
+/*
+ * gpio_sim.c - simulated GPIO pins, stepper motors & end-switches
+ *              for tests of motion engine without Raspberry
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <pthread.h>
+
+#include "gpio.h"
+#include "rtsched.h"
+
+#define SIM_MAX_MOTORS  (4)
+
+static uint32_t levels = 0;  // current levels of all pins
+static sim_motor motors[SIM_MAX_MOTORS];
+static int nmotors = 0;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Electrical angle (0..7, 45 degrees units) of 4-wire motor by levels of its pins
+ * @return -1 if both coils are off
+ */
+static int coils_phase(const sim_motor *m, uint32_t lev){
+	// current direction in coils: +1, 0 or -1
+	int A = ((lev >> m->pins[0]) & 1) - ((lev >> m->pins[1]) & 1);
+	int B = ((lev >> m->pins[2]) & 1) - ((lev >> m->pins[3]) & 1);
+	static const int phases[3][3] = { // [A+1][B+1]
+		{5, 4, 3},
+		{6, -1, 2},
+		{7, 0, 1}
+	};
+	return phases[A+1][B+1];
+}
+
+/**
+ * Change end-switches levels by motor position
+ */
+static void update_esw(const sim_motor *m){
+	int i;
+	for(i = 0; i < 2; ++i){
+		if(m->esw[i] < 0) continue;
+		int pressed = i ? (m->pos >= m->eswpos[1]) : (m->pos <= m->eswpos[0]);
+		if(pressed) levels &= ~PINMASK(m->esw[i]);
+		else levels |= PINMASK(m->esw[i]);
+	}
+}
+
+/**
+ * Move motor by d pulses (if it isn't stalled or stopped by mechanical limits)
+ */
+static void move(sim_motor *m, int d){
+	struct timespec ts;
+	int64_t t;
+	clock_now(&ts);
+	t = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	if(m->maxrate > 0. && m->lastmove && (t - m->lastmove) * m->maxrate < 1e9 * (d > 0 ? d : -d)){
+		m->lost += (d > 0) ? d : -d; // too fast: motor stalls
+		return;
+	}
+	m->lastmove = t;
+	m->pos += d;
+	if(m->pos < m->min){
+		m->lost += m->min - m->pos;
+		m->pos = m->min;
+	}else if(m->pos > m->max){
+		m->lost += m->pos - m->max;
+		m->pos = m->max;
+	}
+	update_esw(m);
+}
+
+/**
+ * React of motor on changing of pins levels
+ */
+static void update_motor(sim_motor *m, uint32_t old, uint32_t lev){
+	if(m->type == SIM_STEPDIR){
+		uint32_t clk = PINMASK(m->pins[2]);
+		// pulse on rising edge of CLK when EN is active; DIR == 0 - positive direction
+		if(!(old & clk) && (lev & clk) && (lev & PINMASK(m->pins[0])))
+			move(m, (lev & PINMASK(m->pins[1])) ? -1 : 1);
+		return;
+	}
+	int ph = coils_phase(m, lev);
+	if(ph < 0 || m->phase < 0){ // coils are off: rotor stays where it was
+		m->phase = ph;
+		return;
+	}
+	int d = (ph - m->phase + 8) % 8;
+	m->phase = ph;
+	if(d == 0 || d == 4) return; // no moving or ambiguous
+	move(m, (d < 4) ? d : d - 8);
+}
+
+int sim_setup(){
+	printf("Simulated GPIO, %s time\n", rtparams.virtime ? "virtual" : "real");
+	return 0;
+}
+
+/**
+ * Add simulated motor
+ * @return its number or -1 if too much motors
+ */
+int sim_add_motor(const sim_motor *m){
+	int n = -1;
+	pthread_mutex_lock(&sim_mutex);
+	if(nmotors < SIM_MAX_MOTORS){
+		n = nmotors++;
+		motors[n] = *m;
+		motors[n].lost = 0;
+		motors[n].lastmove = 0;
+		motors[n].phase = (m->type == SIM_PHASES) ? coils_phase(m, levels) : 0;
+		update_esw(&motors[n]);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+	return n;
+}
+
+/**
+ * Get copy of current state of motor n
+ * @return 0 if all OK
+ */
+int sim_get_motor(int n, sim_motor *m){
+	if(n < 0 || n >= nmotors) return 1;
+	pthread_mutex_lock(&sim_mutex);
+	*m = motors[n];
+	pthread_mutex_unlock(&sim_mutex);
+	return 0;
+}
+
+/**
+ * Change output levels & move motors
+ * @return mask of inputs changed by motors (end-switches)
+ */
+uint32_t sim_write_mask(uint32_t set, uint32_t clr, uint32_t outputs){
+	int i;
+	pthread_mutex_lock(&sim_mutex);
+	uint32_t old = levels;
+	levels = (levels | (set & outputs)) & ~(clr & outputs);
+	for(i = 0; i < nmotors; ++i)
+		update_motor(&motors[i], old, levels);
+	old = (old ^ levels) & ~outputs;
+	pthread_mutex_unlock(&sim_mutex);
+	return old;
+}
+
+uint32_t sim_read_all(){
+	return __atomic_load_n(&levels, __ATOMIC_RELAXED);
+}
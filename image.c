@@ -30,10 +30,22 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <jpeglib.h>
 
 #include "image.h"
+#include "metrics.h"
+#include "trace.h"
+
+#ifndef _U_
+	#define _U_  __attribute__((__unused__))
+#endif
 
 #define BUFSIZE  (204800)
+// quality of difference images
+#define DIFF_QUALITY  (90)
 
 #if defined EBUG || defined DEBUG
 #ifndef DBG
@@ -143,12 +155,59 @@ int open_socket(){
 	return 0;
 }
 
-uint8_t *capture_frame(size_t *sz){
+// socket to image server is used by websockets' & scan threads
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *capture(size_t *sz, uint64_t *rx);
+
+static uint64_t realtime_us(){
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (uint64_t)t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+/**
+ * Get frame from image server
+ * @param sz - length of answer
+ * @param rx - time (realtime, us) when answer began to come (or NULL)
+ * @return answer "jpg\n<length>\n<data>" or NULL
+ */
+uint8_t *capture_frame(size_t *sz, uint64_t *rx){
+	uint8_t *ret;
+	pthread_mutex_lock(&capture_mutex);
+	ret = capture(sz, rx);
+	pthread_mutex_unlock(&capture_mutex);
+	metrics_add(ret ? M_FRAMES_CAPTURED : M_CAPTURE_ERRORS, 1);
+	return ret;
+}
+
+/**
+ * Check whether whole answer "jpg\n<length>\n<data>" is received
+ * @param buf - received data
+ * @param len - its length
+ * @return 1 if all data is here
+ */
+static int answer_complete(const uint8_t *buf, size_t len){
+	const uint8_t *l = memchr(buf, '\n', len), *d;
+	if(!l || !(d = memchr(l + 1, '\n', len - (size_t)(l + 1 - buf)))) return 0;
+	if(l[1] < '0' || l[1] > '9') return 0;
+	char *eptr;
+	long L = strtol((const char*)l + 1, &eptr, 10);
+	if((const uint8_t*)eptr != d || L < 0) return 0;
+	return (size_t)(d + 1 - buf) + (size_t)L <= len;
+}
+
+static uint8_t *capture(size_t *sz, uint64_t *rx){
 	size_t bufsz = BUFSIZE;
-	if(sockfd < 0)if(open_socket()){
-		fprintf(stderr, "Can't open socket");
-		sockfd = -3;
-		return NULL;
+	if(sockfd < 0){
+		if(sockfd != -2){ // not first connection
+			metrics_add(M_CAPTURE_RECONNECTS, 1);
+			trace(TR_RECONNECT, 0, 0);
+		}
+		if(open_socket()){
+			trace(TR_CAPTURE_ERR, TRE_CONNECT, 0);
+			sockfd = -3;
+			return NULL;
+		}
 	}
 	uint8_t *recvBuff = malloc(bufsz);
 	if(!recvBuff) return NULL;
@@ -156,7 +215,7 @@ uint8_t *capture_frame(size_t *sz){
 	size_t L = strlen(msg);
 	ssize_t LL = write(sockfd, msg, L);
 	if((size_t)LL != L){
-		perror("send");
+		trace(TR_CAPTURE_ERR, TRE_SEND, errno);
 		close(sockfd);
 		sockfd = -1;
 		return NULL;
@@ -164,6 +223,8 @@ uint8_t *capture_frame(size_t *sz){
 	DBG("send %s (len=%zd) to fd=%d", msg, L, sockfd);
 	if(!waittoread(sockfd)){
 		DBG("Nothing to read");
+		trace(TR_CAPTURE_ERR, TRE_TIMEOUT, 0);
+		free(recvBuff);
 		return NULL;
 	}
 	size_t offset = 0;
@@ -177,18 +238,24 @@ uint8_t *capture_frame(size_t *sz){
 		LL = read(sockfd, &recvBuff[offset], bufsz - offset);
 		if(!LL) break;
 		if(LL < 0){
-			perror("read");
+			trace(TR_CAPTURE_ERR, TRE_READ, errno);
+			free(recvBuff);
 			return NULL;
 		}
+		if(!offset && rx) *rx = realtime_us(); // header of answer is here
 		offset += (size_t)LL;
+		// don't wait for timeout when all image is already here
+		if(answer_complete(recvBuff, offset)) break;
 	}while(waittoread(sockfd));
 	if(!offset){
-		fprintf(stderr, "Socket closed, try to reopen\n");
+		trace(TR_CAPTURE_ERR, TRE_CLOSED, 0);
+		free(recvBuff);
 		close(sockfd);
 		sockfd = -1;
 		return NULL;
 	}
 	DBG("read %zd bytes\n", offset);
+	trace(TR_CAPTURE, (int32_t)offset, 0);
 	if(sz) *sz = offset;
 	return recvBuff;
 }
@@ -230,41 +297,206 @@ unsigned char *base64_encode(const unsigned char *data,
 }
 
 void prepare_image(imbuf *buf){
-	size_t W;
-	unsigned char *b64 = NULL, *imdata = NULL;
+	uint64_t rx = 0;
 	free_imbuf(buf);
-	buf->data = capture_frame(&(buf->len));
+	buf->data = capture_frame(&(buf->len), &rx);
 	if(!buf->data){
 		return;
 	}
 	DBG("image captured");
+	encode_image(buf, NULL);
+	frame_meta(buf, 0, rx);
+}
+
+static void put_meta(unsigned char *p, uint32_t seq, uint64_t rx, uint64_t ready, uint64_t sent){
+	char s[FRAME_META_LEN + 1];
+	snprintf(s, sizeof(s), "frame=%010u,%016llu,%016llu,%016llu\n", seq, (unsigned long long)rx,
+		(unsigned long long)ready, (unsigned long long)sent);
+	memcpy(p, s, FRAME_META_LEN);
+}
+
+/**
+ * Fill metadata of encoded frame: it's ready now
+ * @param seq - number of frame
+ * @param rx  - time when answer of image server began to come
+ */
+void frame_meta(imbuf *buf, uint32_t seq, uint64_t rx){
+	if(!buf->data || buf->len < FRAME_META_LEN) return;
+	put_meta(buf->data + LWS_SEND_BUFFER_PRE_PADDING, seq, rx, realtime_us(), 0);
+}
+
+/**
+ * Make base64 text ready to send from JPEG data
+ * (with empty metadata, it's filled by frame_meta())
+ * @param out - empty buffer for result
+ */
+static void encode_jpeg(const unsigned char *imdata, size_t L, const char *tag, imbuf *out){
+	size_t W, T = tag ? strlen(tag) : 0;
+	unsigned char *b64 = base64_encode(imdata, L, &W), *p;
+	if(!b64) return;
+	L = W;
+	out->data = malloc(FRAME_META_LEN+T+L+LWS_SEND_BUFFER_PRE_PADDING+LWS_SEND_BUFFER_POST_PADDING);
+	if(!out->data){perror("malloc()"); free(b64); return;}
+	p = out->data + LWS_SEND_BUFFER_PRE_PADDING;
+	put_meta(p, 0, 0, 0, 0);
+	if(T) memcpy(p+FRAME_META_LEN, tag, T);
+	memcpy(p+FRAME_META_LEN+T, b64, L);
+	free(b64);
+	out->len = FRAME_META_LEN+T+L;
+	DBG("image prepared");
+}
+
+/**
+ * Convert answer of image server into base64 text ready to send
+ * @param buf - captured data, will be replaced by encoded
+ * @param tag - text to put before image (or NULL)
+ */
+void encode_image(imbuf *buf, const char *tag){
+	imbuf out = {NULL, 0};
+	unsigned char *imdata = NULL;
 	size_t L = 0;
 	imdata = getsz(buf, &L);
-	if(!imdata){
-		free_imbuf(buf);
-		return;
+	if(imdata) encode_jpeg(imdata, L, tag, &out);
+	free_imbuf(buf);
+	*buf = out;
+}
+
+/*
+ * Frames for websockets' clients are captured by separate thread,
+ * so main thread isn't blocked by image server
+ */
+static pthread_mutex_t last_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t want_cond = PTHREAD_COND_INITIALIZER;
+static imbuf last = {NULL, 0};    // last encoded frame
+static imbuf last_raw = {NULL, 0};// the same frame from image server
+static const unsigned char *last_jpeg = NULL; // JPEG data in it
+static size_t last_jpeg_len = 0;
+static unsigned int last_gen = 0; // its number
+static int wanted = 0;
+static void (*image_notify)() = NULL;
+
+static void *image_thread(_U_ void *arg){
+	imbuf raw, buf;
+	const unsigned char *jpeg;
+	uint64_t rx = 0;
+	size_t L;
+	trace_thread("capture");
+	while(1){
+		pthread_mutex_lock(&last_mutex);
+		while(!wanted) pthread_cond_wait(&want_cond, &last_mutex);
+		wanted = 0;
+		pthread_mutex_unlock(&last_mutex);
+		memset(&buf, 0, sizeof(imbuf));
+		// raw frame is kept for MJPEG stream, encoded - for image protocol
+		if(!(raw.data = capture_frame(&raw.len, &rx))) continue; // clients will ask again
+		if((jpeg = getsz(&raw, &L)) && jpeg + L <= raw.data + raw.len) // not truncated
+			encode_jpeg(jpeg, L, NULL, &buf);
+		if(!buf.data){
+			free_imbuf(&raw);
+			continue;
+		}
+		frame_meta(&buf, last_gen + 1, rx);
+		pthread_mutex_lock(&last_mutex);
+		free_imbuf(&last);
+		free_imbuf(&last_raw);
+		last = buf;
+		last_raw = raw;
+		last_jpeg = jpeg;
+		last_jpeg_len = L;
+		++last_gen;
+		pthread_mutex_unlock(&last_mutex);
+		if(image_notify) image_notify();
 	}
+	return NULL;
+}
 
-	b64 = base64_encode(imdata, L, &W);
-	L = W;
-	free_imbuf(buf);
+/**
+ * Run thread of capturing
+ * @param notify - function called when new frame is ready
+ * @return 0 if all OK
+ */
+int image_start(void (*notify)()){
+	pthread_t thread;
+	image_notify = notify;
+	if(pthread_create(&thread, NULL, image_thread, NULL)){
+		perror("pthread_create()");
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
 
-	buf->data = malloc(L+LWS_SEND_BUFFER_PRE_PADDING+LWS_SEND_BUFFER_POST_PADDING);
-	if(!buf->data){perror("malloc()"); free(b64); return;}
-	memcpy(buf->data+LWS_SEND_BUFFER_PRE_PADDING, b64, L);
-	free(b64);
-	buf->len = L;
-	DBG("image prepared");
+/**
+ * Ask for new frame
+ * @return number of last frame: client should wait for next one
+ */
+unsigned int image_request(){
+	unsigned int gen;
+	pthread_mutex_lock(&last_mutex);
+	wanted = 1;
+	gen = last_gen;
+	pthread_cond_signal(&want_cond);
+	pthread_mutex_unlock(&last_mutex);
+	return gen;
+}
+
+/**
+ * Get copy of frame captured after frame number gen
+ * @param buf - empty buffer, it will own the copy
+ * @param gen - number of frame client has (will be changed to new)
+ * @return 1 if there was such frame
+ */
+int image_get(imbuf *buf, unsigned int *gen){
+	int ret = 0;
+	pthread_mutex_lock(&last_mutex);
+	if(last.data && last_gen != *gen &&
+			(buf->data = malloc(last.len + LWS_SEND_BUFFER_PRE_PADDING + LWS_SEND_BUFFER_POST_PADDING))){
+		memcpy(buf->data + LWS_SEND_BUFFER_PRE_PADDING, last.data + LWS_SEND_BUFFER_PRE_PADDING, last.len);
+		buf->len = last.len;
+		*gen = last_gen;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&last_mutex);
+	return ret;
+}
+
+/**
+ * Get copy of JPEG data of frame captured after frame number gen
+ * @param buf  - empty buffer, it will own the copy (data starts at buf->data + pre)
+ * @param gen  - number of frame client has (will be changed to new)
+ * @param pre  - free space before data (e.g. for headers)
+ * @param post - free space after data
+ * @return 1 if there was such frame
+ */
+int image_get_jpeg(imbuf *buf, unsigned int *gen, size_t pre, size_t post){
+	int ret = 0;
+	pthread_mutex_lock(&last_mutex);
+	if(last_jpeg && last_gen != *gen && (buf->data = malloc(pre + last_jpeg_len + post))){
+		memcpy(buf->data + pre, last_jpeg, last_jpeg_len);
+		buf->len = last_jpeg_len;
+		*gen = last_gen;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&last_mutex);
+	return ret;
 }
 
 void send_buffer(struct libwebsocket *wsi, imbuf *buf){
 	if(!buf->data || !buf->len) return;
 	size_t W = 0, L = buf->len;
 	unsigned char *p = buf->data + LWS_SEND_BUFFER_PRE_PADDING;
+	if(L >= FRAME_META_LEN && !memcmp(p, "frame=", 6)){ // time of sending
+		char s[17];
+		snprintf(s, sizeof(s), "%016llu", (unsigned long long)realtime_us());
+		memcpy(p + FRAME_META_LEN - 17, s, 16);
+	}
 	do{
 		p += W; L -= W;
 		W = libwebsocket_write(wsi, p, L, LWS_WRITE_TEXT);
 	}while(W > 0 && W < L);
+	metrics_add(M_FRAMES_SENT, 1);
+	metrics_add(M_BYTES_IMAGE, buf->len);
+	trace(TR_SEND_IMAGE, (int32_t)buf->len, 0);
 	free_imbuf(buf);
 	DBG("image sent");
 }
@@ -273,3 +505,163 @@ void free_imbuf(imbuf *buf){
 	free(buf->data);
 	memset(buf, 0, sizeof(imbuf));
 }
+
+/*
+ * Lamp-on/lamp-off frames: decoding, difference & its encoding
+ */
+typedef struct{
+	struct jpeg_error_mgr pub;
+	jmp_buf jb;
+} jerr_mgr;
+
+static void jerr_exit(j_common_ptr cinfo){
+	jerr_mgr *e = (jerr_mgr*)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, msg);
+	fprintf(stderr, "libjpeg: %s\n", msg);
+	longjmp(e->jb, 1);
+}
+
+/**
+ * Decode answer of image server into grayscale image
+ * @param raw - captured data ("jpg\n<length>\n<data>")
+ * @param img - image, its buffer is reused if size isn't changed
+ * @return 0 if all OK
+ */
+int decode_frame(imbuf *raw, grayimg *img){
+	struct jpeg_decompress_struct cinfo;
+	jerr_mgr jerr;
+	size_t L = 0;
+	unsigned char *jpg = getsz(raw, &L);
+	if(!jpg || (size_t)(jpg - raw->data) + L > raw->len) return 1;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jerr_exit;
+	if(setjmp(jerr.jb)){
+		jpeg_destroy_decompress(&cinfo);
+		return 1;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, jpg, L);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&cinfo);
+	int W = (int)cinfo.output_width, H = (int)cinfo.output_height;
+	if(!img->data || img->width != W || img->height != H){
+		free(img->data);
+		img->data = malloc((size_t)W * H);
+		if(!img->data){
+			perror("malloc()");
+			jpeg_destroy_decompress(&cinfo);
+			memset(img, 0, sizeof(grayimg));
+			return 1;
+		}
+		img->width = W;
+		img->height = H;
+	}
+	while(cinfo.output_scanline < cinfo.output_height){
+		JSAMPROW row = img->data + (size_t)cinfo.output_scanline * W;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return 0;
+}
+
+// 16 pixels by one operation (NEON register on the Pi)
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+/**
+ * Difference of frames: out = (on - off)/2 + 128 & profile along X
+ * @param out     - image, its buffer is reused if size isn't changed
+ * @param profile - sums of (on - off) by columns (on->width values) or NULL
+ * @return 0 if all OK
+ */
+int diff_frames(const grayimg *on, const grayimg *off, grayimg *out, int32_t *profile){
+	int x, y, W = on->width, H = on->height;
+	size_t i, N = (size_t)W * H;
+	if(!on->data || !off->data || W != off->width || H != off->height) return 1;
+	if(!out->data || out->width != W || out->height != H){
+		free(out->data);
+		if(!(out->data = malloc(N))){
+			memset(out, 0, sizeof(grayimg));
+			return 1;
+		}
+		out->width = W;
+		out->height = H;
+	}
+	const v16u8 one = {1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1}, mid = one * 128;
+	for(i = 0; i + 16 <= N; i += 16){
+		v16u8 a, b;
+		memcpy(&a, on->data + i, 16);
+		memcpy(&b, off->data + i, 16);
+		a = (a >> one) - (b >> one) + mid;
+		memcpy(out->data + i, &a, 16);
+	}
+	for(; i < N; ++i)
+		out->data[i] = (uint8_t)((on->data[i] >> 1) - (off->data[i] >> 1) + 128);
+	if(profile){
+		memset(profile, 0, W * sizeof(int32_t));
+		for(y = 0; y < H; ++y){
+			const uint8_t *a = on->data + (size_t)y * W, *b = off->data + (size_t)y * W;
+			for(x = 0; x < W; ++x)
+				profile[x] += (int)a[x] - (int)b[x];
+		}
+	}
+	return 0;
+}
+
+/**
+ * Encode grayscale image in format of image server answer ("jpg\n<length>\n<data>")
+ * @param buf - buffer for answer (old data is freed)
+ * @return 0 if all OK
+ */
+int gray_to_jpeg(const grayimg *img, imbuf *buf){
+	struct jpeg_compress_struct cinfo;
+	jerr_mgr jerr;
+	unsigned char *jpg = NULL;
+	unsigned long L = 0;
+	char hdr[32];
+	free_imbuf(buf);
+	if(!img->data) return 1;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jerr_exit;
+	if(setjmp(jerr.jb)){
+		jpeg_destroy_compress(&cinfo);
+		free(jpg);
+		return 1;
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &jpg, &L);
+	cinfo.image_width = img->width;
+	cinfo.image_height = img->height;
+	cinfo.input_components = 1;
+	cinfo.in_color_space = JCS_GRAYSCALE;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, DIFF_QUALITY, TRUE);
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_compress(&cinfo, TRUE);
+	while(cinfo.next_scanline < cinfo.image_height){
+		JSAMPROW row = img->data + (size_t)cinfo.next_scanline * img->width;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	size_t H = (size_t)snprintf(hdr, 32, "%s\n%lu\n", IMAGE_FORMAT, L);
+	buf->data = malloc(H + L + 1);
+	if(!buf->data){
+		free(jpg);
+		return 1;
+	}
+	memcpy(buf->data, hdr, H);
+	memcpy(buf->data + H, jpg, L);
+	buf->data[H + L] = 0;
+	buf->len = H + L;
+	free(jpg);
+	return 0;
+}
+
+void free_grayimg(grayimg *img){
+	free(img->data);
+	memset(img, 0, sizeof(grayimg));
+}
@@ -23,19 +23,44 @@
 #ifndef __IMAGE_H__
 #define __IMAGE_H__
 
+#include <stdint.h>
 #include <libwebsockets.h>
 
 #define IMAGE_HOST   "localhost"
 #define IMAGE_PORT   "54321"
 #define IMAGE_FORMAT "jpg"
 
+// line of metadata before each frame of image protocol: "frame=seq,rx,ready,sent\n" -
+// number of frame & times (realtime, us) when answer of image server began to come,
+// when frame was encoded & sent; all fields have fixed width
+#define FRAME_META_LEN  (68)
+
 typedef struct{
 	unsigned char *data;
 	size_t len;
 } imbuf;
 
+// decoded grayscale frame
+typedef struct{
+	int width, height;
+	uint8_t *data;
+} grayimg;
+
+uint8_t *capture_frame(size_t *sz, uint64_t *rx);
+unsigned char *getsz(imbuf *buf, size_t *len);
+unsigned char *base64_encode(const unsigned char *data, size_t input_length, size_t *output_length);
 void prepare_image(imbuf *buf);
+void encode_image(imbuf *buf, const char *tag);
+void frame_meta(imbuf *buf, uint32_t seq, uint64_t rx);
 void free_imbuf(imbuf *buf);
+int decode_frame(imbuf *raw, grayimg *img);
+int diff_frames(const grayimg *on, const grayimg *off, grayimg *out, int32_t *profile);
+int gray_to_jpeg(const grayimg *img, imbuf *buf);
+void free_grayimg(grayimg *img);
 void send_buffer(struct libwebsocket *wsi, imbuf *buf);
+int image_start(void (*notify)());
+unsigned int image_request();
+int image_get(imbuf *buf, unsigned int *gen);
+int image_get_jpeg(imbuf *buf, unsigned int *gen, size_t pre, size_t post);
 
 #endif // __IMAGE_H__
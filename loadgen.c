@@ -0,0 +1,421 @@
+/*
+ * loadgen.c - load generator: N sessions of XY-protocol & image-protocol
+ *             sending commands & requests of frames like test.html or test1.html do
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <libwebsockets.h>
+
+#ifndef _U_
+	#define _U_  __attribute__((__unused__))
+#endif
+
+#define MAXSESSIONS  (256)
+// request without answer is lost after this time (ns)
+#define TIMEOUT      (2000000000LL)
+#define MAXCMD       (64)
+// max amount of commands in mix
+#define MAXMIX       (32)
+
+enum{
+	XY,     // XY-protocol: command -> answer
+	IMAGE,  // image-protocol: "get" -> frame
+	NTYPES
+};
+
+typedef struct{
+	int type;
+	struct libwebsocket *wsi;
+	int open;                 // 1 - established, -1 - failed or closed
+	int rejected;             // XY: server answered "Already connected"
+	int want;                 // request should be written
+	int waiting;              // request is sent, answer isn't received yet
+	int nextcmd;              // XY: number of next command of mix
+	struct timespec next;     // deadline of next request
+	struct timespec sent;     // time of last request
+	char *msg;                // incoming message assembled from fragments
+	size_t len, size;
+} session;
+
+typedef struct{
+	uint64_t sent, answered, oneway, lost, late, other, bytes, fragments;
+	uint32_t *lat;            // latencies, us
+	size_t nlat, szlat;
+} loadstat;
+
+static const char *names[NTYPES] = {"XY", "image"};
+static session sessions[MAXSESSIONS];
+static int nsessions = 0;
+static loadstat stats[NTYPES];
+static double rate[NTYPES] = {10., 0.}; // requests per second per session (0 - next after answer)
+// commands of XY sessions are sent in turn
+typedef struct{
+	char cmd[MAXCMD];
+	int oneway;               // server doesn't answer it
+} xycmd;
+static xycmd mix[MAXMIX];
+static int nmix = 0;
+/*
+ * Messages of web-interfaces: name, queries & all messages (with motion & lamps),
+ * "-" before command means that server doesn't answer it (e.g. release of button)
+ */
+static const char *pages[][3] = {
+	{"test",  "G", "G,-DX+,-UX+,-DY-,-UY-,S250"},
+	{"test1", "G,E,L,Dgetnet", "G,E,L,Dgetnet,DX+,-UX+,DX-,-UX-,DL1,DL1,DL2,DL2,D0,S150"},
+};
+static volatile int force_exit = 0;
+
+static void sighandler(_U_ int sig){
+	force_exit = 1;
+}
+
+static int64_t ns_since(const struct timespec *t0, const struct timespec *t1){
+	return (int64_t)(t1->tv_sec - t0->tv_sec) * 1000000000LL + (t1->tv_nsec - t0->tv_nsec);
+}
+
+static void ts_add_ns(struct timespec *t, int64_t ns){
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000LL;
+	t->tv_nsec = ns % 1000000000LL;
+}
+
+static void add_latency(loadstat *s, int64_t ns){
+	if(s->nlat == s->szlat){
+		size_t sz = s->szlat ? s->szlat * 2 : 4096;
+		uint32_t *p = realloc(s->lat, sz * sizeof(uint32_t));
+		if(!p) return;
+		s->lat = p;
+		s->szlat = sz;
+	}
+	s->lat[s->nlat++] = (uint32_t)(ns / 1000);
+}
+
+/**
+ * Parse comma-separated list of commands into mix
+ * @return 0 if all OK
+ */
+static int parse_mix(const char *list){
+	char buf[MAXMIX * MAXCMD], *tok, *saveptr = NULL;
+	nmix = 0;
+	strncpy(buf, list, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	for(tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)){
+		xycmd *c = &mix[nmix];
+		if(nmix == MAXMIX) return 1;
+		c->oneway = (*tok == '-');
+		if(!tok[c->oneway] || strlen(tok + c->oneway) >= MAXCMD) return 1;
+		strcpy(c->cmd, tok + c->oneway);
+		++nmix;
+	}
+	return nmix ? 0 : 1;
+}
+
+/**
+ * Whole message is received
+ */
+static void got_message(session *ses, const struct timespec *now){
+	loadstat *s = &stats[ses->type];
+	s->bytes += ses->len;
+	if(ses->type == XY && ses->len > 17 && !strncmp(ses->msg, "Already connected", 17)){
+		ses->rejected = 1; // this session is ignored by server
+		ses->waiting = 0;
+		return;
+	}
+	if(!ses->waiting){ // broadcasts & frames of scans
+		++s->other;
+		return;
+	}
+	ses->waiting = 0;
+	++s->answered;
+	add_latency(s, ns_since(&ses->sent, now));
+	if(rate[ses->type] <= 0.) ses->next = *now; // next request at once
+}
+
+static int callback(_U_ struct libwebsocket_context *context,
+			struct libwebsocket *wsi,
+			enum libwebsocket_callback_reasons reason,
+				void *user, void *in, size_t len){
+	session *ses = (session*) user;
+	unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + MAXCMD + LWS_SEND_BUFFER_POST_PADDING];
+	struct timespec now;
+	const char *req = "get";
+	int oneway = 0;
+	size_t L;
+	if(!ses) return 0;
+	switch(reason){
+		case LWS_CALLBACK_CLIENT_ESTABLISHED:
+			ses->open = 1;
+			clock_gettime(CLOCK_MONOTONIC, &ses->next);
+		break;
+		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+		case LWS_CALLBACK_CLOSED:
+			ses->open = -1;
+			ses->wsi = NULL;
+		break;
+		case LWS_CALLBACK_CLIENT_RECEIVE:
+			if(ses->len + len > ses->size){
+				size_t sz = (ses->len + len) * 2;
+				char *p = realloc(ses->msg, sz);
+				if(!p) return -1;
+				ses->msg = p;
+				ses->size = sz;
+			}
+			memcpy(ses->msg + ses->len, in, len);
+			ses->len += len;
+			++stats[ses->type].fragments;
+			if(libwebsocket_is_final_fragment(wsi) && !libwebsockets_remaining_packet_payload(wsi)){
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				got_message(ses, &now);
+				ses->len = 0;
+			}
+		break;
+		case LWS_CALLBACK_CLIENT_WRITEABLE:
+			if(!ses->want) break;
+			if(ses->type == XY){
+				xycmd *c = &mix[ses->nextcmd++ % nmix];
+				req = c->cmd;
+				oneway = c->oneway;
+			}
+			L = strlen(req);
+			memcpy(buf + LWS_SEND_BUFFER_PRE_PADDING, req, L);
+			clock_gettime(CLOCK_MONOTONIC, &ses->sent);
+			if(libwebsocket_write(wsi, buf + LWS_SEND_BUFFER_PRE_PADDING, L, LWS_WRITE_TEXT) < (int)L)
+				return -1;
+			ses->want = 0;
+			++stats[ses->type].sent;
+			if(oneway){ // don't wait for answer
+				++stats[ses->type].oneway;
+				if(rate[ses->type] <= 0.) ses->next = ses->sent;
+			}else ses->waiting = 1;
+		break;
+		default:
+		break;
+	}
+	return 0;
+}
+
+static struct libwebsocket_protocols protocols[] = {
+	{"XY-protocol", callback, 0, 4096, 0, NULL, 0, 0},
+	{"image-protocol", callback, 0, 100000, 0, NULL, 0, 0},
+	{ NULL, NULL, 0, 0, 0, NULL, 0, 0} /* terminator */
+};
+
+/**
+ * Schedule requests of all sessions by absolute deadlines
+ */
+static void schedule(struct libwebsocket_context *context, const struct timespec *now){
+	int i;
+	for(i = 0; i < nsessions; ++i){
+		session *ses = &sessions[i];
+		double r = rate[ses->type];
+		if(ses->open != 1 || ses->rejected) continue;
+		if(ses->waiting && ns_since(&ses->sent, now) > TIMEOUT){
+			ses->waiting = 0;
+			++stats[ses->type].lost;
+			if(r <= 0.) ses->next = *now;
+		}
+		if(ses->want || ses->waiting || ns_since(&ses->next, now) < 0) continue;
+		if(r > 0.){
+			ts_add_ns(&ses->next, (int64_t)(1e9 / r));
+			if(ns_since(&ses->next, now) > 0){ // server can't keep this rate
+				++stats[ses->type].late;
+				ses->next = *now;
+			}
+		}else ses->next.tv_sec += 3600; // next is set by answer
+		ses->want = 1;
+		libwebsocket_callback_on_writable(context, ses->wsi);
+	}
+}
+
+static int cmpu32(const void *a, const void *b){
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const loadstat *s, double p){
+	if(!s->nlat) return 0.;
+	return s->lat[(size_t)(p * (s->nlat - 1))] / 1000.;
+}
+
+/**
+ * CPU time (s) of process pid (0 - this one)
+ */
+static double cpu_time(int pid){
+	char fname[64];
+	unsigned long ut, st;
+	FILE *f;
+	int n;
+	if(!pid){
+		struct rusage u;
+		getrusage(RUSAGE_SELF, &u);
+		return u.ru_utime.tv_sec + u.ru_stime.tv_sec + (u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+	}
+	snprintf(fname, 64, "/proc/%d/stat", pid);
+	if(!(f = fopen(fname, "r"))) return -1.;
+	// utime & stime are 14th & 15th fields, name in brackets can have spaces
+	n = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st);
+	fclose(f);
+	if(n != 2) return -1.;
+	return (double)(ut + st) / sysconf(_SC_CLK_TCK);
+}
+
+static void usage(char *name){
+	printf("Usage: %s [options]\n", name);
+	printf("\t-a host - address of server (default localhost)\n");
+	printf("\t-p port - its port (default 9999)\n");
+	printf("\t-x N    - amount of XY-protocol sessions (default 1)\n");
+	printf("\t-i N    - amount of image-protocol sessions (default 1 for test, 0 for test1)\n");
+	printf("\t-c rate - commands per second of each XY session (default 10)\n");
+	printf("\t-f rate - frames per second of each image session (default 0 - next after answer)\n");
+	printf("\t-w page - send messages of web-interface: test (XY model) or test1 (other model)\n");
+	printf("\t-M      - add messages of motion & lamps buttons of page (really move motors!)\n");
+	printf("\t-C list - comma-separated XY commands sent in turn instead of page's ones,\n");
+	printf("\t          \"-\" before command means that server doesn't answer it (e.g. -UX+)\n");
+	printf("\t-t sec  - duration of test (default 10)\n");
+	printf("\t-P pid  - PID of server (its child process) to measure CPU usage\n");
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	struct libwebsocket_context *context;
+	struct lws_context_creation_info info;
+	struct timespec t0, now, tick;
+	const char *host = "localhost", *page = "test", *list = NULL;
+	int port = 9999, nxy = 1, nimg = -1, duration = 10, pid = 0, moves = 0, npage, opt, i;
+	double cpu0, scpu0 = 0., elapsed;
+	uint64_t lastn[NTYPES] = {0, 0}, lastbytes = 0;
+	while((opt = getopt(argc, argv, "a:p:x:i:c:f:w:MC:t:P:h")) != -1){
+		switch(opt){
+			case 'a': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'x': nxy = atoi(optarg); break;
+			case 'i': nimg = atoi(optarg); break;
+			case 'c': rate[XY] = atof(optarg); break;
+			case 'f': rate[IMAGE] = atof(optarg); break;
+			case 'w': page = optarg; break;
+			case 'M': moves = 1; break;
+			case 'C': list = optarg; break;
+			case 't': duration = atoi(optarg); break;
+			case 'P': pid = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	for(npage = 0; npage < (int)(sizeof(pages) / sizeof(pages[0])); ++npage)
+		if(!strcmp(pages[npage][0], page)) break;
+	if(npage == (int)(sizeof(pages) / sizeof(pages[0]))){
+		fprintf(stderr, "Unknown page %s\n", page);
+		return 1;
+	}
+	if(parse_mix(list ? list : pages[npage][moves ? 2 : 1])){
+		fprintf(stderr, "Wrong list of commands (max %d commands %d symbols each)\n", MAXMIX, MAXCMD - 1);
+		return 1;
+	}
+	if(nimg < 0) nimg = npage ? 0 : 1; // test1.html has no image-protocol
+	if(nxy < 0 || nimg < 0 || nxy + nimg > MAXSESSIONS || nxy + nimg == 0 || duration < 1){
+		fprintf(stderr, "Wrong amount of sessions or duration (max %d sessions)\n", MAXSESSIONS);
+		return 1;
+	}
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	lws_set_log_level(1, NULL); // errors only
+
+	memset(&info, 0, sizeof info);
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.protocols = protocols;
+	info.gid = -1;
+	info.uid = -1;
+	if(!(context = libwebsocket_create_context(&info))){
+		fprintf(stderr, "libwebsocket init failed\n");
+		return 1;
+	}
+	for(i = 0; i < nxy + nimg; ++i){
+		session *ses = &sessions[nsessions];
+		ses->type = (i < nxy) ? XY : IMAGE;
+		ses->nextcmd = i; // sessions send different commands of mix at the same time
+		ses->wsi = libwebsocket_client_connect_extended(context, host, port, 0, "/", host, host,
+			protocols[ses->type].name, -1, ses);
+		if(!ses->wsi){
+			fprintf(stderr, "Can't connect %s session %d\n", names[ses->type], i);
+			continue;
+		}
+		++nsessions;
+	}
+	cpu0 = cpu_time(0);
+	if(pid) scpu0 = cpu_time(pid);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	tick = t0;
+	printf("  time  cmd/s  frames/s    MB/s\n");
+	while(!force_exit){
+		if(libwebsocket_service(context, 1) < 0) break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		schedule(context, &now);
+		if(ns_since(&tick, &now) < 1000000000LL) continue;
+		ts_add_ns(&tick, 1000000000LL);
+		elapsed = ns_since(&t0, &now) / 1e9;
+		printf("%6.1f %6llu %9llu %7.2f\n", elapsed,
+			(unsigned long long)(stats[XY].answered - lastn[XY]),
+			(unsigned long long)(stats[IMAGE].answered + stats[IMAGE].other - lastn[IMAGE]),
+			(stats[IMAGE].bytes - lastbytes) / 1e6);
+		lastn[XY] = stats[XY].answered;
+		lastn[IMAGE] = stats[IMAGE].answered + stats[IMAGE].other;
+		lastbytes = stats[IMAGE].bytes;
+		if(elapsed >= duration) break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ns_since(&t0, &now) / 1e9;
+
+	int opened[NTYPES] = {0, 0}, rejected = 0;
+	for(i = 0; i < nsessions; ++i){
+		if(sessions[i].open != 0) ++opened[sessions[i].type]; // was established or closed after it
+		rejected += sessions[i].rejected;
+	}
+	printf("\n%.1f s, sessions: XY %d/%d (%d rejected by server), image %d/%d\n", elapsed,
+		opened[XY], nxy, rejected, opened[IMAGE], nimg);
+	for(i = 0; i < NTYPES; ++i){
+		loadstat *s = &stats[i];
+		qsort(s->lat, s->nlat, sizeof(uint32_t), cmpu32);
+		printf("%-5s: sent %llu (%llu without answer), answered %llu (%.1f/s), lost %llu, late %llu, "
+			"unsolicited %llu, %.2f MB/s\n", names[i], (unsigned long long)s->sent,
+			(unsigned long long)s->oneway, (unsigned long long)s->answered, s->answered / elapsed,
+			(unsigned long long)s->lost, (unsigned long long)s->late, (unsigned long long)s->other,
+			s->bytes / elapsed / 1e6);
+		if(s->nlat)
+			printf("       latency, ms: p50=%.2f p90=%.2f p99=%.2f p99.9=%.2f max=%.2f\n",
+				percentile(s, .5), percentile(s, .9), percentile(s, .99), percentile(s, .999),
+				s->lat[s->nlat - 1] / 1000.);
+	}
+	printf("CPU: loadgen %.1f%%", (cpu_time(0) - cpu0) / elapsed * 100.);
+	if(pid){
+		double c = cpu_time(pid);
+		if(c < 0. || scpu0 < 0.) printf(", server: can't read /proc/%d/stat", pid);
+		else printf(", server %.1f%%", (c - scpu0) / elapsed * 100.);
+	}
+	printf("\n");
+	libwebsocket_context_destroy(context);
+	return 0;
+}
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <syslog.h>
 
 #include <signal.h>
@@ -42,9 +43,18 @@
 #include <sys/prctl.h>
 
 #include <pthread.h>
+#include <poll.h>
 
 #include "stepper.h"
 #include "image.h"
+#include "scan.h"
+#include "rtsched.h"
+#include "gpio.h"
+#include "state.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "trace.h"
+#include "assets.h"
 
 #if defined EBUG || defined DEBUG
 #ifndef DBG
@@ -68,19 +78,38 @@ typedef struct{
 	int idxrd;
 	char message[MESSAGE_QUEUE_SIZE][MESSAGE_LEN];
 	int already_connected;
+	// HTTP connection of MJPEG stream
+	int mjpeg;
+	unsigned int gen;   // number of last frame sent
 }per_session_data;
 
 char *client_IP = NULL; // IP of first connected client
 
 per_session_data global_queue;
-pthread_mutex_t command_mutex, ip_mutex;
+pthread_mutex_t ip_mutex;
 
-char cmd_buf[5] = {0};
-volatile int data_in_buf = 0; // signals that there's some data in cmd_buf to send to motors
+#define CMDBUFLEN  (64)
+// max size of metrics' text
+#define METRICS_BUFSZ  (16384)
+// MJPEG stream: URI, max amount of clients & max size of part header
+#define MJPEG_URI         "/stream.mjpg"
+#define MJPEG_MAXCLIENTS  (8)
+#define MJPEG_PARTHDR     (128)
+
+// individual data per session of image protocol
+typedef struct{
+	imbuf buf;        // frame to send
+	int want;         // client waits for frame
+	unsigned int gen; // number of last frame it has
+}image_session;
 
 void put_message_to_queue(char *msg, per_session_data *dat){
 	int L = strlen(msg);
-	if(dat->num >= MESSAGE_QUEUE_SIZE) return;
+	if(dat->num >= MESSAGE_QUEUE_SIZE){
+		metrics_add(M_MSG_DROPPED, 1);
+		trace(TR_MSG_DROPPED, 0, 0);
+		return;
+	}
 	dat->num++;
 	if(L < 1 || L > MESSAGE_LEN - 1) L = MESSAGE_LEN - 1;
 	strncpy(dat->message[dat->idxwr], msg, L);
@@ -100,6 +129,9 @@ int force_exit = 0;
 
 //**************************************************************************//
 
+static struct libwebsocket_context *ws_context = NULL;
+
+
 /**
  * Process buffer with incoming commands
  * Protocol:
@@ -110,18 +142,49 @@ int force_exit = 0;
  *
  * Sxxx - set steppers speed to xxx
  * G - get steppers speed
+ * R - get requested & achieved step rate
+ * Pca,d,v,t - set acceleration profile of axis c: acceleration a, deceleration d
+ *          (steps/s^2), max speed v (steps/s), type t ('t' - trapezoidal, 's' - S-curve)
+ * Pc - get acceleration profile of axis c
+ * Mdx,dy - coordinated move of both axes to dx, dy steps
+ * Ax,y - coordinated move of both axes to absolute position x, y
+ * Acn - move axis c to absolute position n
+ * Lcm1,m2,... - put moves of axis c into queue: mi is +n/-n for relative move
+ *          or @n for move to absolute position n
+ * Q - get absolute positions ('?' - position is unknown)
+ * H - forget positions & go to center through mechanical stops
+ * Ccs,d,n - scan by axis c: capture frames on n positions from s with step d,
+ *          frames with tags "scan=i,c:pos\n" are sent by image protocol
+ * C0 - stop scan
+ * Fn,k,s - differential frames: lamp n (1 or 2) is turned on & off with settling
+ *          time s ms, k (0 - until stop) differences "on - off" are sent by image
+ *          protocol with tags "diff=i,lamp=n,profile=p0,p1,...\n"
+ * F0 - stop differential frames
+ *          each frame of image protocol begins with line
+ *          "frame=seq,rx,ready,sent\n" (fixed width, times in us of realtime clock)
+ * T - get amount of restarts & time from last (re)start to ready state
+ * Jc - get lateness of axis c pulses (us) & CPU usage of steppers' thread
+ * J0 - clear lateness statistics
  */
 void process_buf(char *command){
-	char que[33];
-	int dir = 0;
-	long X;
+	char que[MESSAGE_LEN];
+	int dir = 0, axis = -1, ret, lamp, settle;
+	char *ptr, *eptr;
+	long X, Y;
+	double req[2], ach[2];
+	unsigned int missed;
+	char type;
+	motion_profile prof;
+	jitter_stat jit;
 	void (*moveFN)(int, unsigned int) = NULL;
 	switch (command[1]){
 		case 'X':
 			moveFN = Xmove;
+			axis = 0;
 		break;
 		case 'Y':
 			moveFN = Ymove;
+			axis = 1;
 		break;
 	}
 	switch (command[2]){
@@ -141,6 +204,118 @@ void process_buf(char *command){
 			snprintf(que, 32, "curspd=%d", get_motors_speed());
 			put_message_to_queue(que, &global_queue);
 		break;
+		case 'R': // get step rate: requested/achieved & missed deadlines
+			missed = get_step_rate(0, &req[0], &ach[0]);
+			missed += get_step_rate(1, &req[1], &ach[1]);
+			snprintf(que, 64, "rate=X:%.1f/%.1f,Y:%.1f/%.1f missed=%u",
+				ach[0], req[0], ach[1], req[1], missed);
+			put_message_to_queue(que, &global_queue);
+		break;
+		case 'P': // set or get acceleration profile
+			if(axis < 0) break;
+			get_motion_profile(axis, &prof);
+			if(command[2]){
+				type = 's';
+				if(sscanf(&command[2], "%d,%d,%d,%c", &prof.accel, &prof.decel,
+						&prof.vmax, &type) < 3) break;
+				prof.scurve = (type == 's');
+				if(set_motion_profile(axis, &prof)){
+					put_message_to_queue("Wrong profile parameters", &global_queue);
+					break;
+				}
+			}
+			snprintf(que, 64, "prof=%c,%d,%d,%d,%c", command[1], prof.accel,
+				prof.decel, prof.vmax, prof.scurve ? 's' : 't');
+			put_message_to_queue(que, &global_queue);
+		break;
+		case 'M': // coordinated move of both axes
+			if(sscanf(&command[1], "%ld,%ld", &X, &Y) != 2) break;
+			if(XYmove(X, Y))
+				put_message_to_queue("Motors are busy", &global_queue);
+		break;
+		case 'A': // move to absolute position
+			if(axis < 0){
+				if(sscanf(&command[1], "%ld,%ld", &X, &Y) != 2) break;
+				ret = XYmove_to(X, Y);
+			}else
+				ret = move_to(axis, strtol(&command[2], NULL, 10));
+			if(ret == 1)
+				put_message_to_queue("Motors are busy", &global_queue);
+			else if(ret == 2)
+				put_message_to_queue("Position is unknown, go to the middle first", &global_queue);
+		break;
+		case 'L': // queue of moves
+			if(axis < 0) break;
+			ptr = &command[2];
+			while(*ptr){
+				int relative = 1;
+				if(*ptr == '@'){
+					relative = 0;
+					++ptr;
+				}
+				X = strtol(ptr, &eptr, 10);
+				if(eptr == ptr) break;
+				if((ret = queue_move(axis, X, relative))){
+					put_message_to_queue((ret == 1) ? "Queue is full" :
+						"Position is unknown, go to the middle first", &global_queue);
+					break;
+				}
+				ptr = eptr;
+				if(*ptr == ',') ++ptr;
+			}
+		break;
+		case 'Q': // get absolute positions
+			ret = get_position(0, &X);
+			dir = get_position(1, &Y);
+			snprintf(que, 64, "pos=X:%ld%s,Y:%ld%s", X, ret ? "" : "?", Y, dir ? "" : "?");
+			put_message_to_queue(que, &global_queue);
+		break;
+		case 'C': // scan
+			if(command[1] == '0'){
+				scan_stop();
+				break;
+			}
+			if(axis < 0 || sscanf(&command[2], "%ld,%ld,%d", &X, &Y, &dir) != 3) break;
+			ret = scan_start(axis, X, Y, dir, reactor_wake);
+			if(ret == 1)
+				put_message_to_queue("Scan is running", &global_queue);
+			else if(ret == 2)
+				put_message_to_queue("Wrong scan parameters", &global_queue);
+		break;
+		case 'F': // differential frames
+			if(command[1] == '0'){
+				scan_stop();
+				break;
+			}
+			if(sscanf(&command[1], "%d,%d,%d", &lamp, &dir, &settle) != 3) break;
+			ret = scan_diff(lamp, dir, settle, reactor_wake);
+			if(ret == 1)
+				put_message_to_queue("Scan is running", &global_queue);
+			else if(ret == 2)
+				put_message_to_queue("Wrong parameters of differential frames", &global_queue);
+			else if(ret == 3)
+				put_message_to_queue("Lamp isn't fitted", &global_queue);
+		break;
+		case 'T': // restarts
+			if(!state_get()) break;
+			snprintf(que, MESSAGE_LEN, "restarts=%u ready=%.1fms", state_get()->restarts,
+				state_get()->ready / 1e6);
+			put_message_to_queue(que, &global_queue);
+		break;
+		case 'H': // full homing
+			XY_home();
+		break;
+		case 'J': // jitter of pulses
+			if(command[1] == '0'){
+				clear_jitter();
+				break;
+			}
+			if(get_jitter(axis, &jit)) break;
+			snprintf(que, MESSAGE_LEN, "jitter=%c n=%u min=%.1f p50=%.1f p90=%.1f p99=%.1f "
+				"p99.9=%.1f max=%.1f us missed=%u cpu=%.1f%%", command[1], jit.count, jit.min,
+				jit.p50, jit.p90, jit.p99, jit.p999, jit.max, jit.missed, get_steppers_cpu());
+			put_message_to_queue(que, &global_queue);
+		break;
 		case 'D': // button pressed
 			if(command[1] == '0') // go to start point for further moving to middle
 				XY_gotocenter();
@@ -153,6 +328,8 @@ void process_buf(char *command){
 	}
 }
 
+static void after_events();
+
 #define MESG(X) do{if(dat) put_message_to_queue(X, dat);}while(0)
 void websig(char *command, per_session_data *dat){
 	size_t L;
@@ -160,11 +337,68 @@ void websig(char *command, per_session_data *dat){
 		MESG("Empty command!");
 		return;
 	}
+	trace_str(TR_CMD, command);
 	if(command[0] == 'S'){
 		MESG("Change speed");
 		goto ret;
 	}
-	if(command[0] == 'G'){ // get speed
+	if(command[0] == 'G' || command[0] == 'R' || command[0] == 'Q' || command[0] == 'T'){ // get speed, rate, position or restarts
+		goto ret;
+	}
+	if(command[0] == 'H'){
+		MESG("Go to the middle through mechanical stops. Please, wait!");
+		goto ret;
+	}
+	if(command[0] == 'P'){ // acceleration profile
+		if(L < 2 || (command[1] != 'X' && command[1] != 'Y')){
+			MESG("Undefined coordinate");
+			return;
+		}
+		goto ret;
+	}
+	if(command[0] == 'J'){ // jitter
+		if(L < 2 || (command[1] != 'X' && command[1] != 'Y' && command[1] != '0')){
+			MESG("Broken command!");
+			return;
+		}
+		goto ret;
+	}
+	if(command[0] == 'C'){ // scan
+		if(L < 2 || (command[1] != 'X' && command[1] != 'Y' && command[1] != '0')){
+			MESG("Broken command!");
+			return;
+		}
+		goto ret;
+	}
+	if(command[0] == 'F'){ // differential frames
+		if(L < 2 || (command[1] != '0' && command[1] != '1' && command[1] != '2')){
+			MESG("Broken command!");
+			return;
+		}
+		goto ret;
+	}
+	if(command[0] == 'L'){ // queue of moves
+		if(L < 3 || (command[1] != 'X' && command[1] != 'Y')){
+			MESG("Broken command!");
+			return;
+		}
+		goto ret;
+	}
+	if(command[0] == 'A' && L > 2 && (command[1] == 'X' || command[1] == 'Y')){ // absolute move of one axis
+		char *eptr;
+		strtol(&command[2], &eptr, 10);
+		if(eptr == &command[2]){
+			MESG("Broken command!");
+			return;
+		}
+		goto ret;
+	}
+	if(command[0] == 'M' || command[0] == 'A'){ // move both axes: Mdx,dy or Ax,y
+		long dx, dy;
+		if(sscanf(&command[1], "%ld,%ld", &dx, &dy) != 2){
+			MESG("Broken command!");
+			return;
+		}
 		goto ret;
 	}
 	if(command[0] != 'D' && command[0] != 'U'){
@@ -191,13 +425,11 @@ void websig(char *command, per_session_data *dat){
 		return;
 	}
 ret:
-	while(data_in_buf); // wait for execution of last command
-	pthread_mutex_lock(&command_mutex);
-	strncpy(cmd_buf, command, 4);
-	data_in_buf = 1;
-	pthread_mutex_unlock(&command_mutex);
+	process_buf(command); // commands are executed by reactor at once
+	after_events();
 }
 
+#if defined EBUG || defined DEBUG
 static void dump_handshake_info(struct libwebsocket *wsi){
 	int n;
 	static const char *token_names[] = {
@@ -268,6 +500,9 @@ static void dump_handshake_info(struct libwebsocket *wsi){
 		printf("    %s = %s\n", token_names[n], buf);
 	}
 }
+#else
+#define dump_handshake_info(wsi)
+#endif
 
 /*
 reasons:
@@ -311,6 +546,135 @@ reasons:
     LWS_CALLBACK_USER = 1000, // user code can use any including / above
 */
 
+/**
+ * Events on socket of websockets
+ */
+static void lws_service(int fd, int revents, _U_ void *arg){
+	struct pollfd pfd = {fd, (short)revents, (short)revents};
+	if(ws_context) libwebsocket_service_fd(ws_context, &pfd);
+}
+
+/**
+ * Answer by file of web-interface
+ * @return 1 if there's no such file
+ */
+static int serve_asset(struct libwebsocket *wsi, const char *uri){
+	char inm[128], ae[128], buf[256];
+	asset_reply r;
+	int have_inm = 0, have_ae = 0;
+	if(lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0 &&
+		lws_hdr_copy(wsi, inm, sizeof(inm), WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0) have_inm = 1;
+	if(lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0 &&
+		lws_hdr_copy(wsi, ae, sizeof(ae), WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0) have_ae = 1;
+	if(assets_reply(uri, have_inm ? inm : NULL, have_ae ? ae : NULL, &r, buf, sizeof(buf)))
+		return 1;
+	libwebsocket_write(wsi, (unsigned char*)r.data, r.len, LWS_WRITE_HTTP);
+	metrics_add(M_BYTES_HTTP, r.len);
+	if(r.status == 304) metrics_add(M_HTTP_NOT_MODIFIED, 1);
+	return 0;
+}
+
+/*
+ * MJPEG stream: JPEG data from image server are sent as they are by parts
+ * of multipart/x-mixed-replace, each part is sent when capture thread gets
+ * new frame & socket is ready (slow clients miss frames)
+ */
+static struct libwebsocket *mjpeg_clients[MJPEG_MAXCLIENTS];
+static int nmjpeg = 0;
+
+static int mjpeg_start(struct libwebsocket *wsi, per_session_data *dat){
+	static const char *busy = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+	static const char *hdr = "HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+			"Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+	if(nmjpeg == MJPEG_MAXCLIENTS){
+		libwebsocket_write(wsi, (unsigned char*)busy, strlen(busy), LWS_WRITE_HTTP);
+		return -1;
+	}
+	if(libwebsocket_write(wsi, (unsigned char*)hdr, strlen(hdr), LWS_WRITE_HTTP) < 0) return -1;
+	metrics_add(M_BYTES_HTTP, strlen(hdr));
+	libwebsocket_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+	mjpeg_clients[nmjpeg++] = wsi;
+	dat->mjpeg = 1;
+	dat->gen = image_request();
+	return 0;
+}
+
+static void mjpeg_stop(struct libwebsocket *wsi, per_session_data *dat){
+	int i;
+	if(!dat->mjpeg) return;
+	dat->mjpeg = 0;
+	for(i = 0; i < nmjpeg; ++i)
+		if(mjpeg_clients[i] == wsi){
+			mjpeg_clients[i] = mjpeg_clients[--nmjpeg];
+			break;
+		}
+}
+
+/**
+ * Send next part of MJPEG stream
+ * @return -1 to close connection
+ */
+static int mjpeg_send(struct libwebsocket_context *context, struct libwebsocket *wsi,
+				per_session_data *dat){
+	imbuf buf = {NULL, 0};
+	char hdr[MJPEG_PARTHDR];
+	size_t H;
+	int W;
+	if(!dat->mjpeg) return 0;
+	if(lws_send_pipe_choked(wsi)){ // previous part isn't sent yet
+		libwebsocket_callback_on_writable(context, wsi);
+		return 0;
+	}
+	if(!image_get_jpeg(&buf, &dat->gen, MJPEG_PARTHDR, 2)) return 0; // no new frame yet
+	H = (size_t)snprintf(hdr, MJPEG_PARTHDR, "--frame\r\nContent-Type: image/jpeg\r\n"
+		"Content-Length: %zu\r\n\r\n", buf.len);
+	// part header just before JPEG data & CRLF after them
+	memcpy(buf.data + MJPEG_PARTHDR - H, hdr, H);
+	memcpy(buf.data + MJPEG_PARTHDR + buf.len, "\r\n", 2);
+	W = libwebsocket_write(wsi, buf.data + MJPEG_PARTHDR - H, H + buf.len + 2, LWS_WRITE_HTTP);
+	free_imbuf(&buf);
+	if(W < 0) return -1;
+	metrics_add(M_FRAMES_SENT, 1);
+	metrics_add(M_BYTES_HTTP, W);
+	trace(TR_SEND_IMAGE, W, 0);
+	image_request(); // next frame
+	return 0;
+}
+
+/**
+ * HTTP requests: GET /metrics - counters for Prometheus
+ * @return -1 to close connection
+ */
+static int serve_http(struct libwebsocket *wsi, per_session_data *dat, const char *uri){
+	char hdr[160];
+	size_t H, L;
+	unsigned char *buf;
+	metrics_add(M_HTTP_REQUESTS, 1);
+	if(uri && !strcmp(uri, MJPEG_URI)) return mjpeg_start(wsi, dat);
+	if(!uri || strcmp(uri, "/metrics")){
+		static const char *notfound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+		if(uri && !serve_asset(wsi, uri)) return -1;
+		strcpy(hdr, notfound);
+		L = strlen(hdr);
+		libwebsocket_write(wsi, (unsigned char*)hdr, L, LWS_WRITE_HTTP);
+		metrics_add(M_BYTES_HTTP, L);
+		return -1;
+	}
+	if(!(buf = malloc(LWS_SEND_BUFFER_PRE_PADDING + sizeof(hdr) + METRICS_BUFSZ))) return -1;
+	L = metrics_format((char*)buf + LWS_SEND_BUFFER_PRE_PADDING + sizeof(hdr), METRICS_BUFSZ);
+	if(L >= METRICS_BUFSZ) L = METRICS_BUFSZ - 1;
+	H = (size_t)snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n", L);
+	// header just before body
+	memcpy(buf + LWS_SEND_BUFFER_PRE_PADDING + sizeof(hdr) - H, hdr, H);
+	libwebsocket_write(wsi, buf + LWS_SEND_BUFFER_PRE_PADDING + sizeof(hdr) - H, H + L, LWS_WRITE_HTTP);
+	metrics_add(M_BYTES_HTTP, H + L);
+	free(buf);
+	return -1;
+}
+
 static int my_protocol_callback(struct libwebsocket_context *context,
 			struct libwebsocket *wsi,
 			enum libwebsocket_callback_reasons reason,
@@ -322,14 +686,18 @@ static int my_protocol_callback(struct libwebsocket_context *context,
 	char client_ip[128];
 	char *M, *msg = (char*) in;
 	per_session_data *dat = (per_session_data *) user;
+	struct libwebsocket_pollargs *pa = (struct libwebsocket_pollargs *) in;
+	struct timespec t0, t1;
 	int L, W;
 	void sendmsg(char *M){
 		L = strlen(M);
-		strncpy((char *)p, M, L);
+		memcpy(p, M, L);
 		W = libwebsocket_write(wsi, p, L, LWS_WRITE_TEXT);
 		if(L != W){
 			lwsl_err("Can't write to socket");
 		}
+		if(W > 0) metrics_add(M_BYTES_XY, W);
+		trace(TR_SEND_XY, W, 0);
 	}
 	inline void parse_queue_msg(per_session_data *d){
 		if((M = get_message_from_queue(d))){
@@ -338,7 +706,26 @@ static int my_protocol_callback(struct libwebsocket_context *context,
 	}
 	//DBG("my proto. reason: %d\n", reason);
 	switch (reason) {
+		// sockets of all protocols are watched by reactor
+		case LWS_CALLBACK_ADD_POLL_FD:
+			reactor_add(pa->fd, pa->events, lws_service, NULL);
+		break;
+		case LWS_CALLBACK_DEL_POLL_FD:
+			reactor_del(pa->fd);
+		break;
+		case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+			reactor_mod(pa->fd, pa->events);
+		break;
+		case LWS_CALLBACK_HTTP:
+			return serve_http(wsi, dat, msg);
+		case LWS_CALLBACK_HTTP_WRITEABLE:
+			return mjpeg_send(context, wsi, dat);
+		case LWS_CALLBACK_CLOSED_HTTP:
+			mjpeg_stop(wsi, dat);
+		break;
 		case LWS_CALLBACK_ESTABLISHED:
+			metrics_add(M_XY_OPENED, 1);
+			trace(TR_XY_OPEN, 0, 0);
 			memset(dat, 0, sizeof(per_session_data));
 			pthread_mutex_lock(&ip_mutex);
 			libwebsockets_get_peer_addresses(context, wsi, libwebsocket_get_socket_fd(wsi),
@@ -358,30 +745,32 @@ static int my_protocol_callback(struct libwebsocket_context *context,
 			libwebsocket_callback_on_writable(context, wsi);
 		break;
 		case LWS_CALLBACK_SERVER_WRITEABLE:
-			if(dat->num || global_queue.num){
-				parse_queue_msg(dat);
-				if(!dat->already_connected)
-					parse_queue_msg(&global_queue);
-			}
-			libwebsocket_callback_on_writable(context, wsi);
+			parse_queue_msg(dat);
+			if(!dat->already_connected)
+				parse_queue_msg(&global_queue);
+			if(dat->num || (!dat->already_connected && global_queue.num))
+				libwebsocket_callback_on_writable(context, wsi);
 		break;
 		case LWS_CALLBACK_RECEIVE:
+			clock_gettime(CLOCK_MONOTONIC, &t0);
 			if(!dat->already_connected)
 				websig(msg, dat);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			metrics_latency(ts_diff(&t1, &t0));
+			if(dat->num) libwebsocket_callback_on_writable(context, wsi);
 			//else DBG("got message: %s\n", msg);
 			//else return -1;
 		break;
 		case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
-			libwebsockets_get_peer_addresses(context, wsi, (int)(long)in,
-				client_name, 127, client_ip, 127);
-			printf("Received network connection from %s (%s)\n", client_name, client_ip);
+			trace(TR_CONNECT, (int)(long)in, 0);
 		break;
 		case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
-			printf("Client asks for %s\n", msg);
+			DBG("Client asks for %s", msg);
 			dump_handshake_info(wsi);
 		break;
 		case LWS_CALLBACK_CLOSED:
-			printf("Client disconnected\n");
+			metrics_add(M_XY_CLOSED, 1);
+			trace(TR_XY_CLOSE, 0, 0);
 			if(!dat->already_connected){
 				pthread_mutex_lock(&ip_mutex);
 				free(client_IP);
@@ -401,40 +790,40 @@ static int improto_callback(_U_ struct libwebsocket_context *context,
 			_U_ struct libwebsocket *wsi,
 			enum libwebsocket_callback_reasons reason,
 				void *user, void *in, _U_ size_t len){
-	char client_name[128];
-	char client_ip[128];
-	char *msg = (char*) in;
-	imbuf *buf = (imbuf*) user;
+	image_session *ses = (image_session*) user;
 	//struct lws_tokens *tok = (struct lws_tokens *) user;
 	switch (reason) {
 		case LWS_CALLBACK_ESTABLISHED:
-			printf("New Connection\n");
-			memset(buf, 0, sizeof(imbuf));
-			prepare_image(buf);
-			libwebsocket_callback_on_writable(context, wsi);
+			metrics_add(M_IMAGE_OPENED, 1);
+			trace(TR_IMAGE_OPEN, 0, 0);
+			memset(ses, 0, sizeof(image_session));
+			ses->gen = image_request();
+			ses->want = 1;
 		break;
 		case LWS_CALLBACK_SERVER_WRITEABLE:
-			if(buf->data){
-				send_buffer(wsi, buf);
+			if(!ses->buf.data) scan_pop(&ses->buf); // frames of scan
+			if(!ses->buf.data && ses->want && image_get(&ses->buf, &ses->gen))
+				ses->want = 0;
+			if(ses->buf.data){
+				send_buffer(wsi, &ses->buf);
 				libwebsocket_callback_on_writable(context, wsi);
 			}
 		break;
-		case LWS_CALLBACK_RECEIVE:
-			prepare_image(buf);
+		case LWS_CALLBACK_RECEIVE: // frame is sent when capture thread gets it
+			ses->gen = image_request();
+			ses->want = 1;
 		break;
 		case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
-			libwebsockets_get_peer_addresses(context, wsi, (int)(long)in,
-				client_name, 127, client_ip, 127);
-			printf("Received network connection from %s (%s)\n",
-							client_name, client_ip);
+			trace(TR_CONNECT, (int)(long)in, 0);
 		break;
 		case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
-			printf("Client asks for %s\n", msg);
+			DBG("Client asks for %s", (char*)in);
 			dump_handshake_info(wsi);
 		break;
 		case LWS_CALLBACK_CLOSED:
-			free_imbuf(buf);
-			printf("Client disconnected\n");
+			metrics_add(M_IMAGE_CLOSED, 1);
+			trace(TR_IMAGE_CLOSE, 0, 0);
+			free_imbuf(&ses->buf);
 		break;
 	/*	case LWS_CALLBACK_GET_THREAD_ID:
 			return pthread_self();
@@ -455,13 +844,13 @@ static struct libwebsocket_protocols protocols[] = {
 		"XY-protocol",				// name
 		my_protocol_callback,		// callback
 		sizeof(per_session_data),	// per_session_data_size
-		10,							// max frame size / rx buffer
+		CMDBUFLEN,					// max frame size / rx buffer
 		0, NULL, 0, 0
 	},
 	{
 		"image-protocol",
 		improto_callback,
-		sizeof(imbuf),
+		sizeof(image_session),
 		100000,
 		0, NULL, 0, 0
 	},
@@ -471,24 +860,60 @@ static struct libwebsocket_protocols protocols[] = {
 //**************************************************************************//
 void sighandler(_U_ int sig){
 	force_exit = 1;
+	reactor_wake();
 	printf("Exit\n");
 }
 
-void *websock_thread(_U_ void *buf){
+/**
+ * Things to do after commands & wakeups: next queued moves & messages
+ */
+static void after_events(){
+	char que[MESSAGE_LEN];
+	static int ready = 0;
+	if(!ready && ws_context && steppers_ready()){
+		ready = 1;
+		state_ready();
+		scan_resume(reactor_wake); // job of previous child
+	}
+	steppers_poll();
+	if(center_reached){
+		center_reached = 0;
+		put_message_to_queue("Center reached!", &global_queue);
+	}
+	if(scan_result(que, sizeof(que)))
+		put_message_to_queue(que, &global_queue);
+	if(ws_context && global_queue.num)
+		libwebsocket_callback_on_writable_all_protocol(&protocols[0]);
+}
+
+/**
+ * Wakeup by other thread: axis stopped, motors are ready, new frame or end of scan
+ */
+static void on_wake(){
+	int i;
+	after_events();
+	if(!ws_context) return;
+	// there could be frames to send
+	libwebsocket_callback_on_writable_all_protocol(&protocols[1]);
+	for(i = 0; i < nmjpeg; ++i)
+		libwebsocket_callback_on_writable(ws_context, mjpeg_clients[i]);
+}
+
+/**
+ * Periodic servicing of websockets' timeouts
+ */
+static void lws_timer(_U_ int fd, _U_ int revents, _U_ void *arg){
+	if(ws_context) libwebsocket_service_fd(ws_context, NULL);
+}
+
+static struct libwebsocket_context *websock_init(){
 	struct libwebsocket_context *context;
-	int n = 0;
 	int opts = 0;
 	const char *iface = NULL;
 	int syslog_options = LOG_PID | LOG_PERROR;
-	//unsigned int oldus = 0;
 	struct lws_context_creation_info info;
 	int debug_level = 7;
 
-	if(pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL)){
-		force_exit = 1;
-		return NULL;
-	}
-
 	memset(&info, 0, sizeof info);
 	info.port = 9999;
 
@@ -509,58 +934,115 @@ void *websock_thread(_U_ void *buf){
 	info.uid = -1;
 	info.options = opts;
 
+	// sockets are added to reactor by LWS_CALLBACK_ADD_POLL_FD
 	context = libwebsocket_create_context(&info);
 	if (context == NULL){
 		lwsl_err("libwebsocket init failed\n");
-		force_exit = 1;
 		return NULL;
 	}
-
-	while(n >= 0 && !force_exit){
-		n = libwebsocket_service(context, 500);
-	}//while n>=0
-	libwebsocket_context_destroy(context);
-	lwsl_notice("libwebsockets-test-server exited cleanly\n");
-	closelog();
-	return NULL;
+	return context;
 }
 
+/**
+ * Main thread of child: reactor serves websockets, commands & events of other threads
+ */
 static inline void main_proc(){
-	pthread_t w_thread, s_thread;
-	pthread_create(&w_thread, NULL, websock_thread, NULL);
+	pthread_t s_thread;
+	trace_thread("reactor");
+	trace(TR_START, getpid(), 0);
+	if(reactor_init(on_wake) || !(ws_context = websock_init()) || reactor_timer(1000, lws_timer, NULL)){
+		force_exit = 1;
+		return;
+	}
+	image_start(reactor_wake);
+	steppers_notify(reactor_wake);
 	pthread_create(&s_thread, NULL, steppers_thread, NULL);
 
-	while(!force_exit){
-		pthread_mutex_lock(&command_mutex);
-		if(data_in_buf) process_buf(cmd_buf);
-		data_in_buf = 0;
-		pthread_mutex_unlock(&command_mutex);
-		usleep(100); // give another treads some time to fill buffer
-		if(center_reached){
-			center_reached = 0;
-			put_message_to_queue("Center reached!", &global_queue);
-		}
-	}
-	pthread_cancel(s_thread); // cancel steppers' thread
+	reactor_run(&force_exit);
+
+	scan_stop();
+	steppers_stop();
 	pthread_join(s_thread, NULL);
 	steppers_relax();
-	pthread_join(w_thread, NULL); // wait for closing of libsockets thread
+	libwebsocket_context_destroy(ws_context);
+	ws_context = NULL;
+	lwsl_notice("libwebsockets-test-server exited cleanly\n");
+	closelog();
+}
+
+static void usage(char *name){
+	printf("Usage: %s [-p prio] [-c cpu] [-m] [-s] [-v]\n", name);
+	printf("\t-p prio - run steppers' thread with SCHED_FIFO priority prio\n");
+	printf("\t-c cpu  - pin steppers' thread to CPU cpu\n");
+	printf("\t-m      - lock all memory (mlockall)\n");
+	printf("\t-s      - simulate GPIO & motors (always on PC)\n");
+	printf("\t-v      - virtual time for simulation (motors run as fast as possible)\n");
+	exit(1);
 }
 
 //**************************************************************************//
-int main(_U_ int argc, _U_ char **argv){
+int main(int argc, char **argv){
+	int opt;
+	while((opt = getopt(argc, argv, "p:c:msvh")) != -1){
+		switch(opt){
+			case 'p':
+				rtparams.priority = atoi(optarg);
+			break;
+			case 'c':
+				rtparams.cpu = atoi(optarg);
+			break;
+			case 'm':
+				rtparams.memlock = 1;
+			break;
+			case 's':
+				gpio_simulate = 1;
+			break;
+			case 'v':
+				rtparams.virtime = 1;
+			break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(rtparams.virtime && !gpio_simulate){
+		fprintf(stderr, "Virtual time can be used only with simulation\n");
+		rtparams.virtime = 0;
+	}
 	signal(SIGTERM, sighandler);	// kill (-15)
 	signal(SIGINT, sighandler);		// ctrl+C
 	signal(SIGQUIT, SIG_IGN);		// ctrl+\  .
 	signal(SIGTSTP, SIG_IGN);		// ctrl+Z
 
+	// instrument state & flight recorder are kept by supervisor
+	steppers_open_state();
+	state_cold();
+	if(assets_load(ASSETS_DIR))
+		fprintf(stderr, "Not all files of web-interface are loaded from " ASSETS_DIR "\n");
+	if(trace_open(TRACE_FILE, 0))
+		fprintf(stderr, "Can't map " TRACE_FILE ", flight recorder is off\n");
 	while(1){
 		if(force_exit) return 0;
+		state_start();
+		trace_reset();
+		fflush(stdout); // don't duplicate buffered output in child
 		pid_t childpid = fork();
+		if(childpid < 0){
+			perror("fork()");
+			sleep(1); // don't try again at once (signal interrupts it)
+			continue;
+		}
 		if(childpid){
 			printf("Created child with PID %d\n", childpid);
-			wait(NULL);
-			printf("Child %d died\n", childpid);
+			int status;
+			pid_t ret;
+			while((ret = waitpid(childpid, &status, 0)) < 0 && errno == EINTR);
+			if(ret < 0)
+				perror("waitpid()");
+			else if(WIFSIGNALED(status))
+				printf("Child %d killed by signal %d\n", childpid, WTERMSIG(status));
+			else
+				printf("Child %d died with status %d\n", childpid, WEXITSTATUS(status));
+			trace_dump(stdout, TRACE_DUMP_LAST);
 		}else{
 			prctl(PR_SET_PDEATHSIG, SIGTERM); // send SIGTERM to child when parent dies
 			main_proc();
@@ -0,0 +1,154 @@
+/*
+ * metrics.c - counters of all threads for Prometheus: each thread writes only
+ *             its own block (lock-free, own cache line), reader sums blocks
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "stepper.h"
+
+// upper bounds of command latency histogram, us
+static const int lat_bounds[] = {10, 50, 100, 500, 1000, 5000, 10000, 50000};
+#define NBUCKETS  (int)(sizeof(lat_bounds) / sizeof(lat_bounds[0]))
+
+typedef struct{
+	uint64_t c[M_NCOUNTERS];
+	uint64_t lat[NBUCKETS + 1];  // last is +Inf
+	uint64_t lat_sum;            // ns
+} __attribute__((aligned(64))) metrics_block;
+
+static metrics_block blocks[METRICS_MAXTHREADS];
+static metrics_block spare;  // for threads over METRICS_MAXTHREADS (atomic adds)
+static int nblocks = 0;
+static __thread metrics_block *mine = NULL;
+
+static const struct{
+	const char *name, *help;
+	int type; // 0 - counter, 1 - gauge: opened - closed
+} counters[M_NCOUNTERS] = {
+	{"frames_captured_total", "Frames got from image server", 0},
+	{"capture_errors_total", "Failed captures", 0},
+	{"capture_reconnects_total", "Reconnections to image server", 0},
+	{"frames_sent_total", "Frames sent by image protocol", 0},
+	{"image_bytes_total", "Bytes sent by image protocol", 0},
+	{"xy_bytes_total", "Bytes sent by XY-protocol", 0},
+	{"http_bytes_total", "Bytes sent by HTTP", 0},
+	{"messages_dropped_total", "Messages dropped by full queue", 0},
+	{"xy_sessions", "Sessions of XY-protocol", 1},
+	{NULL, NULL, 0},
+	{"image_sessions", "Sessions of image protocol", 1},
+	{NULL, NULL, 0},
+	{"http_requests_total", "Requests by HTTP", 0},
+	{"http_not_modified_total", "Answers 304 Not Modified", 0}
+};
+
+static metrics_block *block(){
+	if(!mine){
+		int n = __atomic_fetch_add(&nblocks, 1, __ATOMIC_RELAXED);
+		mine = (n < METRICS_MAXTHREADS) ? &blocks[n] : &spare;
+	}
+	return mine;
+}
+
+// the only writer of own block: no read-modify-write is needed
+static inline void inc(uint64_t *v, uint64_t n){
+	metrics_block *b = block();
+	if(b == &spare) __atomic_fetch_add(v, n, __ATOMIC_RELAXED);
+	else __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void metrics_add(int counter, uint64_t n){
+	if(counter < 0 || counter >= M_NCOUNTERS) return;
+	inc(&block()->c[counter], n);
+}
+
+/**
+ * Latency of command (from receiving to end of execution)
+ */
+void metrics_latency(int64_t ns){
+	metrics_block *b = block();
+	int i;
+	for(i = 0; i < NBUCKETS && ns > lat_bounds[i] * 1000LL; ++i);
+	inc(&b->lat[i], 1);
+	inc(&b->lat_sum, (uint64_t)(ns > 0 ? ns : 0));
+}
+
+// sum of field of all blocks
+#define SUM(field) ({ \
+	int i_, n_ = __atomic_load_n(&nblocks, __ATOMIC_RELAXED); \
+	uint64_t s_ = __atomic_load_n(&spare.field, __ATOMIC_RELAXED); \
+	if(n_ > METRICS_MAXTHREADS) n_ = METRICS_MAXTHREADS; \
+	for(i_ = 0; i_ < n_; ++i_) s_ += __atomic_load_n(&blocks[i_].field, __ATOMIC_RELAXED); \
+	s_; })
+
+#define PUT(...) do{if(L < len) L += (size_t)snprintf(buf + L, len - L, __VA_ARGS__);}while(0)
+
+/**
+ * Text of all metrics in Prometheus exposition format
+ * @return its length (it could be more than len if buffer is too small)
+ */
+size_t metrics_format(char *buf, size_t len){
+	size_t L = 0;
+	int i, axis;
+	uint64_t cum = 0;
+	jitter_stat j;
+	for(i = 0; i < M_NCOUNTERS; ++i){
+		if(!counters[i].name) continue;
+		PUT("# HELP rasp_%s %s\n# TYPE rasp_%s %s\n", counters[i].name, counters[i].help,
+			counters[i].name, counters[i].type ? "gauge" : "counter");
+		if(counters[i].type) // opened - closed
+			PUT("rasp_%s %lld\n", counters[i].name, (long long)(SUM(c[i]) - SUM(c[i+1])));
+		else
+			PUT("rasp_%s %llu\n", counters[i].name, (unsigned long long)SUM(c[i]));
+	}
+	PUT("# HELP rasp_command_latency_seconds Time from receiving of command to end of its execution\n"
+		"# TYPE rasp_command_latency_seconds histogram\n");
+	for(i = 0; i <= NBUCKETS; ++i){
+		cum += SUM(lat[i]);
+		if(i < NBUCKETS) PUT("rasp_command_latency_seconds_bucket{le=\"%g\"} %llu\n", lat_bounds[i] / 1e6,
+			(unsigned long long)cum);
+		else PUT("rasp_command_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cum);
+	}
+	PUT("rasp_command_latency_seconds_sum %.6f\nrasp_command_latency_seconds_count %llu\n",
+		SUM(lat_sum) / 1e9, (unsigned long long)cum);
+	// lateness of pulses: steppers' thread keeps it in its own histograms; quantiles
+	// are of samples since last J0, sum & count are totals since start (monotonic)
+	PUT("# HELP rasp_step_jitter_seconds Lateness of step pulses\n# TYPE rasp_step_jitter_seconds summary\n");
+	for(axis = 0; axis < 2; ++axis){
+		char c = axis ? 'Y' : 'X';
+		if(get_jitter(axis, &j)) continue;
+		PUT("rasp_step_jitter_seconds{axis=\"%c\",quantile=\"0.5\"} %g\n"
+			"rasp_step_jitter_seconds{axis=\"%c\",quantile=\"0.9\"} %g\n"
+			"rasp_step_jitter_seconds{axis=\"%c\",quantile=\"0.99\"} %g\n"
+			"rasp_step_jitter_seconds{axis=\"%c\",quantile=\"0.999\"} %g\n"
+			"rasp_step_jitter_seconds_sum{axis=\"%c\"} %.6f\n"
+			"rasp_step_jitter_seconds_count{axis=\"%c\"} %llu\n",
+			c, j.p50 / 1e6, c, j.p90 / 1e6, c, j.p99 / 1e6, c, j.p999 / 1e6,
+			c, j.total_late / 1e6, c, (unsigned long long)j.total);
+	}
+	PUT("# HELP rasp_missed_deadlines_total Pulses made after next deadline\n"
+		"# TYPE rasp_missed_deadlines_total counter\n");
+	for(axis = 0; axis < 2; ++axis)
+		if(!get_jitter(axis, &j))
+			PUT("rasp_missed_deadlines_total{axis=\"%c\"} %llu\n", axis ? 'Y' : 'X',
+				(unsigned long long)j.total_missed);
+	return L;
+}
@@ -0,0 +1,54 @@
+/*
+ * metrics.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// max amount of threads with counters
+#define METRICS_MAXTHREADS  (16)
+
+// counters
+enum{
+	M_FRAMES_CAPTURED,     // frames got from image server
+	M_CAPTURE_ERRORS,      // failed captures
+	M_CAPTURE_RECONNECTS,  // reconnections to image server
+	M_FRAMES_SENT,         // frames sent by image protocol
+	M_BYTES_IMAGE,         // bytes sent by image protocol
+	M_BYTES_XY,            // bytes sent by XY-protocol
+	M_BYTES_HTTP,          // bytes sent by HTTP
+	M_MSG_DROPPED,         // messages dropped by full queue
+	M_XY_OPENED,           // sessions of XY-protocol
+	M_XY_CLOSED,
+	M_IMAGE_OPENED,        // sessions of image protocol
+	M_IMAGE_CLOSED,
+	M_HTTP_REQUESTS,
+	M_HTTP_NOT_MODIFIED,   // answers 304
+	M_NCOUNTERS
+};
+
+void metrics_add(int counter, uint64_t n);
+void metrics_latency(int64_t ns);
+size_t metrics_format(char *buf, size_t len);
+
+#endif // __METRICS_H__
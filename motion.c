@@ -0,0 +1,707 @@
+/*
+ * motion.c - table-driven motion engine: any amount of axes is served by
+ *            single thread, each axis has its own deadline of next pulse
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "motion.h"
+#include "gpio.h"
+
+// pins of DRIVE_STEPDIR axis
+#define EN(a)   ((a)->pins[0])
+#define DIR(a)  ((a)->pins[1])
+#define CLK(a)  ((a)->pins[2])
+
+// moves are joined only if there's enough pulses before deceleration
+#define JOIN_MARGIN  (8)
+
+// levels of pins {A+, A-, B+, B-} packed into bits 0..3
+#define PHASE(ap, am, bp, bm)  ((ap) | ((am) << 1) | ((bp) << 2) | ((bm) << 3))
+// half-stepping sequence, 1,1 - coil is off: even phases are two coils (full steps),
+// odd phases are one coil (wave drive)
+static const uint8_t phases[8] = {
+	PHASE(1, 0, 0, 1),
+	PHASE(1, 0, 1, 1),
+	PHASE(1, 0, 1, 0),
+	PHASE(1, 1, 1, 0),
+	PHASE(0, 1, 1, 0),
+	PHASE(0, 1, 1, 1),
+	PHASE(0, 1, 0, 1),
+	PHASE(1, 1, 0, 1)
+};
+
+static axis_t *axes = NULL;
+static int naxes = 0;
+static clockid_t cpuclock; // CPU time of steppers' thread
+static volatile int cpuclock_ok = 0;
+// idle steppers' thread sleeps until some axis starts or motion_stop() is called
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static volatile int stopping = 0;
+// writers of plans (main thread & steppers' thread when homing) are serialized
+static pthread_mutex_t plan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Masks of pins to set & clear for relaxed (disabled) axis
+ */
+static void relax_masks(const axis_t *a, uint32_t *set, uint32_t *clr){
+	if(a->drive == DRIVE_STEPDIR){
+		*set |= PINMASK(DIR(a)) | PINMASK(CLK(a));
+		*clr |= PINMASK(EN(a));
+	}else *clr |= a->mask;
+}
+
+/**
+ * Configure pins of all axes & disable motors
+ * @param ax - table of axes (it should exist all the time engine works)
+ * @param n  - its size
+ */
+void motion_setup(axis_t *ax, int n){
+	int i, j, k, npins;
+	axes = ax;
+	naxes = n;
+	for(i = 0; i < n; ++i){
+		axis_t *a = &ax[i];
+		npins = (a->drive == DRIVE_STEPDIR) ? 3 : 4;
+		a->mask = 0;
+		for(j = 0; j < npins; ++j){
+			gpio_mode(a->pins[j], GPIO_OUT);
+			a->mask |= PINMASK(a->pins[j]);
+		}
+		for(k = 0; k < 8; ++k){
+			a->phase_set[k] = 0;
+			for(j = 0; j < 4; ++j)
+				if(phases[k] & (1 << j)) a->phase_set[k] |= PINMASK(a->pins[j]);
+			a->phase_clr[k] = a->mask & ~a->phase_set[k];
+		}
+		a->clk = 1;
+		a->phase_inc = 1;
+		if(a->drive == DRIVE_PHASES) axis_step_mode(a, a->stepmode);
+		a->ramp = a->plan.ramp = &a->ramps[0];
+		make_ramp(a->ramp, &a->profile, a->profile.vmax, axis_ppstep(a));
+	}
+	motion_relax();
+}
+
+/**
+ * Disable all motors
+ */
+void motion_relax(){
+	uint32_t set = 0, clr = 0;
+	int i;
+	for(i = 0; i < naxes; ++i) relax_masks(&axes[i], &set, &clr);
+	gpio_write_mask(set, clr);
+}
+
+/**
+ * Take last plan of move (steppers' thread between pulses or owner of stopped axis);
+ * reader of seqlock doesn't spin: if plan is being changed, it's taken by next pulse
+ * @return 0 if plan is taken
+ */
+static int take_plan(axis_t *a){
+	move_plan p;
+	unsigned int s = __atomic_load_n(&a->plan_seq, __ATOMIC_ACQUIRE);
+	if(s & 1) return 1;
+	p = a->plan;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&a->plan_seq, __ATOMIC_RELAXED) != s) return 1;
+	__atomic_store_n(&a->ramp, p.ramp, __ATOMIC_RELEASE);
+	a->stopat = p.stopat;
+	a->nacc = p.nacc;
+	a->ndec = p.ndec;
+	__atomic_store_n(&a->plan_used, s, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Publish new plan of move (plan_mutex should be locked): running axis
+ * takes it between pulses, stopped one - at once
+ */
+static void set_plan(axis_t *a, const move_plan *p){
+	unsigned int s = a->plan_seq;
+	__atomic_store_n(&a->plan_seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	a->plan = *p;
+	__atomic_store_n(&a->plan_seq, s + 2, __ATOMIC_RELEASE);
+	if(!__atomic_load_n(&a->running, __ATOMIC_ACQUIRE)) take_plan(a);
+}
+
+/**
+ * Compute new acceleration tables & plan move of N pulses (plan_mutex should be locked)
+ * (new tables are written into buffer steppers' thread doesn't use)
+ * @param vmax - max speed of this move
+ * @return 0 if all OK, 1 if previous tables aren't taken yet
+ */
+static int prepare_move(axis_t *a, unsigned int N, int vmax){
+	ramp_t *used = __atomic_load_n(&a->ramp, __ATOMIC_ACQUIRE);
+	ramp_t *r = (used == &a->ramps[0]) ? &a->ramps[1] : &a->ramps[0];
+	move_plan p;
+	if(a->running && a->plan.ramp != used) return 1; // both buffers are busy
+	make_ramp(r, &a->profile, vmax, axis_ppstep(a));
+	p.ramp = r;
+	p.stopat = N;
+	plan_move(r, &a->profile, N, &p.nacc, &p.ndec);
+	set_plan(a, &p);
+	return 0;
+}
+
+/**
+ * Enable motor & set its direction
+ */
+static void start(axis_t *a, int dir){
+	a->dir = dir;
+	a->abort = 0;
+	if(a->drive == DRIVE_STEPDIR){ // CW - >0, CCW - <0
+		if(dir > 0) gpio_write_mask(PINMASK(EN(a)), PINMASK(DIR(a)));
+		else gpio_write_mask(PINMASK(EN(a)) | PINMASK(DIR(a)), 0);
+	} // 4-wire motor is enabled by first pulse
+	if(!a->running) a->restart = 1;
+	__atomic_store_n(&a->running, 1, __ATOMIC_RELEASE); // plan is ready
+	// flag is set before locking, so steppers' thread can't miss it
+	pthread_mutex_lock(&idle_mutex);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+static int home_next(axis_t *a);
+
+/**
+ * Disable motor (called from steppers' thread)
+ */
+static void halt(axis_t *a){
+	uint32_t set = 0, clr = 0;
+	if(a->drive == DRIVE_STEPDIR){
+		clr = PINMASK(EN(a));
+		if(!a->clk) set = PINMASK(CLK(a));
+		a->clk = 1;
+	}else clr = a->mask;
+	gpio_write_mask(set, clr);
+	a->running = 0;
+	if(home_next(a)) return; // homing isn't finished yet
+	if(a->on_stop) a->on_stop(a);
+}
+
+/**
+ * Count pulse made by axis
+ * @return !0 if axis should be stopped
+ */
+static int count_pulse(axis_t *a, const struct timespec *now){
+	a->steps++;
+	if(a->pos) // the only writer is steppers' thread
+		__atomic_store_n(a->pos, *a->pos + a->dir * a->phase_inc, __ATOMIC_RELAXED);
+	rate_count(&a->meter, now);
+	if(a->on_pulse) return a->on_pulse(a, now);
+	return 0;
+}
+
+/**
+ * Stop axis & its follower
+ */
+static void finish(axis_t *a, const struct timespec *now){
+	axis_t *f = a->follower;
+	if(f){
+		if(f->drive == DRIVE_STEPDIR && !f->clk){ // finish pulse started
+			f->clk = 1;
+			gpio_write(CLK(f), 1);
+			count_pulse(f, now);
+		}
+		a->follower = NULL;
+		f->leader = NULL;
+		halt(f);
+	}
+	halt(a);
+}
+
+/**
+ * Start (or make) pulse of follower when its leader starts pulse
+ * @return !0 if axes should be stopped
+ */
+static int follower_pulse(axis_t *f, const struct timespec *now, uint32_t *set, uint32_t *clr){
+	if(f->drive == DRIVE_STEPDIR){ // rising edge will be made with next edge of leader
+		f->clk = 0;
+		*clr |= PINMASK(CLK(f));
+		return 0;
+	}
+	f->phase = (f->phase + f->dir * f->phase_inc) & 7;
+	*set = (*set & ~f->mask) | f->phase_set[f->phase];
+	*clr = (*clr & ~f->mask) | f->phase_clr[f->phase];
+	return count_pulse(f, now);
+}
+
+/**
+ * Process deadline of axis: make edge of CLK or change phase
+ */
+static void process(axis_t *a, const struct timespec *now){
+	axis_t *f = a->follower;
+	uint32_t set = 0, clr = 0, p;
+	int begin = 1, done = 0, stop = 0;
+	int64_t late;
+	if(a->abort || (f && f->abort)){
+		finish(a, now);
+		return;
+	}
+	if(__atomic_load_n(&a->plan_seq, __ATOMIC_RELAXED) != a->plan_used) take_plan(a);
+	// step loop only indexes precomputed tables
+	p = ramp_period(a->ramp, a->steps, a->stopat, a->nacc, a->ndec);
+	a->period = p;
+	late = ts_diff(now, &a->next);
+	jitter_add(&a->jitter, late, late > (long)p);
+	if(late > (long)p){
+		// late for more than pulse period: don't try to catch up with burst
+		++a->meter.missed;
+		a->next = *now;
+	}
+	if(a->drive == DRIVE_STEPDIR){
+		if(a->clk){ // pulse starts by falling edge
+			if(a->stopat && a->steps >= a->stopat){ // all pulses are made
+				finish(a, now);
+				return;
+			}
+			a->clk = 0;
+			clr = PINMASK(CLK(a));
+		}else{ // and ends by rising edge
+			a->clk = 1;
+			set = PINMASK(CLK(a));
+			begin = 0;
+			done = 1;
+		}
+		ts_add(&a->next, p / 2);
+	}else{
+		if(a->stopat && a->steps >= a->stopat){
+			finish(a, now);
+			return;
+		}
+		a->phase = (a->phase + a->dir * a->phase_inc) & 7;
+		set = a->phase_set[a->phase];
+		clr = a->phase_clr[a->phase];
+		done = 1;
+		ts_add(&a->next, p);
+	}
+	if(f){ // follower makes its pulses simultaneously with leader
+		if(f->drive == DRIVE_STEPDIR && !f->clk){
+			f->clk = 1;
+			set |= PINMASK(CLK(f));
+			stop |= count_pulse(f, now);
+		}
+		if(begin && (a->bres_err -= a->bres_minor) < 0){
+			a->bres_err += a->bres_major;
+			if(f->steps < f->stopat){
+				stop |= follower_pulse(f, now, &set, &clr);
+				f->period = (uint64_t)p * a->bres_major / a->bres_minor;
+			}
+		}
+	}
+	gpio_write_mask(set, clr); // all pins by single write
+	if(done) stop |= count_pulse(a, now);
+	if(stop) finish(a, now);
+}
+
+/**
+ * Move stopped axis in direction dir to N pulses
+ * (if N == 0 then move infinitely)
+ * dir == 0 - stop motor with deceleration
+ * @param vmax - max speed of this move
+ * @return 0 if all OK, 1 if axis is busy or already on end-switch
+ */
+int axis_move(axis_t *a, int dir, unsigned int N, int vmax){
+	if(dir == 0){
+		axis_soft_stop(a);
+		return 0;
+	}
+	if(a->running || a->leader || a->follower) return 1; // stop it first
+	if(a->limits & LIMIT_BIT(dir)) return 1; // already on end-switch
+	pthread_mutex_lock(&plan_mutex);
+	a->steps = 0;
+	prepare_move(a, N, vmax); // stopped axis: tables are free
+	pthread_mutex_unlock(&plan_mutex);
+	start(a, dir);
+	return 0;
+}
+
+/**
+ * Change max speed of moving axis (for profiles without acceleration)
+ */
+void axis_set_speed(axis_t *a, int vmax){
+	pthread_mutex_lock(&plan_mutex);
+	if(a->running && !a->leader) prepare_move(a, a->plan.stopat, vmax);
+	pthread_mutex_unlock(&plan_mutex);
+}
+
+/**
+ * Stop moving motor with deceleration
+ */
+void axis_soft_stop(axis_t *a){
+	axis_t *l = a->leader;
+	move_plan p;
+	if(l) a = l; // stop leading axis, follower stops with it
+	if(!a->running) return;
+	pthread_mutex_lock(&plan_mutex);
+	p = a->plan;
+	p.stopat = a->steps + stop_length(p.ramp, a->period) + 1;
+	// finite move will stop earlier
+	if(!a->plan.stopat || a->plan.stopat > p.stopat){
+		p.ndec = p.ramp->ndec;
+		set_plan(a, &p);
+	}
+	pthread_mutex_unlock(&plan_mutex);
+}
+
+/**
+ * Stop motor at once (or disable it if it isn't moving)
+ */
+void axis_stop(axis_t *a){
+	uint32_t set = 0, clr = 0;
+	if(a->homing < HOMING_DONE && a->homing != HOMING_NONE) a->homing = HOMING_FAILED;
+	if(a->running){
+		a->abort = 1; // steppers' thread will stop it
+		return;
+	}
+	relax_masks(a, &set, &clr);
+	gpio_write_mask(set, clr);
+}
+
+/**
+ * Change step mode of DRIVE_PHASES axis
+ * (positions are counted in half-steps in any mode)
+ * @param mode - STEP_HALF, STEP_FULL or STEP_WAVE
+ * @return 0 if all OK, 1 if axis is moving, 2 if mode is wrong
+ */
+int axis_step_mode(axis_t *a, int mode){
+	if(a->running) return 1;
+	if(a->drive != DRIVE_PHASES || mode < STEP_HALF || mode > STEP_WAVE) return 2;
+	a->stepmode = mode;
+	a->phase_inc = (mode == STEP_HALF) ? 1 : 2;
+	// coils are off now, so next pulse just starts from phase of right parity
+	if(mode == STEP_FULL) a->phase &= ~1;
+	else if(mode == STEP_WAVE) a->phase |= 1;
+	return 0;
+}
+
+/**
+ * @return pulses per step in current step mode
+ */
+int axis_ppstep(const axis_t *a){
+	return a->ppstep / a->phase_inc;
+}
+
+/**
+ * Edge of end-switch: stop axis moving to it
+ */
+static void on_limit(int pin, int level, void *arg){
+	axis_t *a = (axis_t*)arg, *l = a->leader;
+	int dir = ((a->limit_used & 2) && pin == a->limit_pin[1]) ? 1 : -1;
+	if(level){
+		__atomic_and_fetch(&a->limits, ~LIMIT_BIT(dir), __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_or_fetch(&a->limits, LIMIT_BIT(dir), __ATOMIC_RELAXED);
+	if(a->running && a->dir == dir){
+		a->abort = 1;
+		if(l) l->abort = 1;
+	}
+}
+
+/**
+ * Connect end-switch, which stops axis moving in direction dir
+ * (it's checked by edge events, so steppers' thread don't read it)
+ * @param debounce_us - switch should hold its level for this time (us)
+ * @return 0 if all OK
+ */
+int axis_limit(axis_t *a, int dir, int pin, unsigned int debounce_us){
+	int side = (dir > 0) ? 1 : 0;
+	a->limit_pin[side] = pin;
+	gpio_mode(pin, GPIO_IN);
+	gpio_pullup(pin); // switch is active low: released one shouldn't float
+	if(!gpio_read(pin)) a->limits |= LIMIT_BIT(dir);
+	if(gpio_watch(pin, debounce_us, on_limit, a)) return 1;
+	a->limit_used |= LIMIT_BIT(dir);
+	return 0;
+}
+
+/**
+ * Start homing: fast approach to end-switch in direction dir, back off
+ * until it's released & slow approach to it again; position where switch
+ * is pressed becomes zero
+ * When homing finished on_stop is called, a->homing is HOMING_DONE or HOMING_FAILED
+ * @param vfast, vslow - speeds of approaches
+ * @param backoff      - pulses to move back (switch should be released after them)
+ * @return 0 if all OK, 1 if axis is busy or there's no end-switch
+ */
+int axis_home(axis_t *a, int dir, int vfast, int vslow, unsigned int backoff){
+	if(a->running || a->leader || !(a->limit_used & LIMIT_BIT(dir))) return 1;
+	a->home_dir = dir;
+	a->home_fast = vfast;
+	a->home_slow = vslow;
+	a->home_backoff = backoff;
+	if(a->limits & LIMIT_BIT(dir)){ // already on switch
+		a->homing = HOMING_BACKOFF;
+		axis_move(a, -dir, backoff, vfast);
+	}else{
+		a->homing = HOMING_FAST;
+		axis_move(a, dir, 0, vfast);
+	}
+	return 0;
+}
+
+/**
+ * Next stage of homing when axis stops (called from steppers' thread)
+ * @return 1 if axis moves again
+ */
+static int home_next(axis_t *a){
+	int pressed = a->limits & LIMIT_BIT(a->home_dir);
+	switch(a->homing){
+		case HOMING_FAST:
+			if(!pressed) break;
+			a->homing = HOMING_BACKOFF;
+			axis_move(a, -a->home_dir, a->home_backoff, a->home_fast);
+			return 1;
+		case HOMING_BACKOFF:
+			if(pressed) break; // switch is stuck
+			a->homing = HOMING_SLOW;
+			axis_move(a, a->home_dir, 2 * a->home_backoff, a->home_slow);
+			return 1;
+		case HOMING_SLOW:
+			if(!pressed) break;
+			if(a->pos) __atomic_store_n(a->pos, 0, __ATOMIC_RELAXED);
+			a->homing = HOMING_DONE;
+			return 0;
+		default:
+			return 0;
+	}
+	a->homing = HOMING_FAILED;
+	return 0;
+}
+
+/**
+ * Coordinated linear move of two axes, so they arrive together
+ * (axis with larger delta runs by its profile, another one is stepped from it)
+ * @param da, db - amount of pulses by each axis, sign is direction
+ * @return 0 if all OK, 1 if axes are busy
+ */
+int axis_line(axis_t *a, axis_t *b, long da, long db){
+	unsigned int d[2] = {labs(da), labs(db)};
+	int dir[2] = {(da > 0) ? 1 : -1, (db > 0) ? 1 : -1};
+	axis_t *ax[2] = {a, b};
+	int major, vmax;
+	if(a->running || b->running) return 1;
+	if(!d[1]){ // single axis move
+		if(d[0]) axis_move(a, dir[0], d[0], a->profile.vmax);
+		return 0;
+	}
+	if(!d[0]){
+		axis_move(b, dir[1], d[1], b->profile.vmax);
+		return 0;
+	}
+	major = (d[0] >= d[1]) ? 0 : 1;
+	axis_t *l = ax[major], *f = ax[!major];
+	l->bres_major = d[major];
+	l->bres_minor = d[!major];
+	l->bres_err = d[major] / 2;
+	l->steps = f->steps = 0;
+	vmax = (a->profile.vmax < b->profile.vmax) ? a->profile.vmax : b->profile.vmax;
+	pthread_mutex_lock(&plan_mutex);
+	set_plan(f, &(move_plan){f->plan.ramp, d[!major], 0, 0}); // follower uses only stopat
+	prepare_move(l, d[major], vmax);
+	pthread_mutex_unlock(&plan_mutex);
+	f->period = 0;
+	f->leader = l;
+	start(f, dir[!major]);
+	__atomic_store_n(&l->follower, f, __ATOMIC_RELEASE);
+	start(l, dir[major]);
+	return 0;
+}
+
+/**
+ * Get requested & really achieved (in last second of moving) speed
+ * @param requested - steps per second by current pulse period
+ * @param achieved  - measured steps per second
+ * @return amount of missed deadlines
+ */
+unsigned int axis_rate(axis_t *a, double *requested, double *achieved){
+	uint32_t p = a->period;
+	if(requested) *requested = p ? 1e9 / (p * (double)axis_ppstep(a)) : 0.;
+	if(achieved) *achieved = a->meter.achieved / axis_ppstep(a); // meter counts pulses
+	return a->meter.missed;
+}
+
+/**
+ * Put move of d pulses (sign is direction) into queue of axis
+ * @return 0 if all OK, 1 if queue is full
+ */
+int axis_queue(axis_t *a, long d){
+	unsigned int t = (a->qtail + 1) % MOTION_QLEN;
+	if(t == a->qhead) return 1;
+	a->queue[a->qtail] = d;
+	a->qtail = t;
+	return 0;
+}
+
+/**
+ * Position of axis after all queued moves
+ * (moves are in pulses, position changes by phase_inc on each of them)
+ * @return 0 if it's unknown (position isn't tracked or axis moves infinitely)
+ */
+int axis_queue_end(axis_t *a, long *pos){
+	unsigned int i;
+	long p = 0;
+	if(!a->pos) return 0;
+	if(a->running){
+		if(!a->plan.stopat) return 0;
+		p = a->dir * (long)(a->plan.stopat - a->steps);
+	}
+	for(i = a->qhead; i != a->qtail; i = (i + 1) % MOTION_QLEN)
+		p += a->queue[i];
+	*pos = *a->pos + p * a->phase_inc;
+	return 1;
+}
+
+/**
+ * Clear queue of moves
+ */
+void axis_flush(axis_t *a){
+	a->qhead = a->qtail;
+}
+
+/**
+ * Add d pulses to current move (which isn't decelerating yet)
+ * (new plan is taken by steppers' thread between pulses)
+ */
+static void extend(axis_t *a, unsigned int d){
+	move_plan p = a->plan;
+	p.stopat += d;
+	// longer move: acceleration can only grow & deceleration point moves forward
+	plan_move(p.ramp, &a->profile, p.stopat, &p.nacc, &p.ndec);
+	set_plan(a, &p);
+}
+
+/**
+ * Execute queued moves (should be called by main thread after queueing and
+ * after each stop of axis): lookahead joins all moves in the same direction
+ * into one, so there's no stops between them; next moves are added to running
+ * move if it isn't decelerating yet; change of direction waits until motor stops
+ */
+void motion_poll(){
+	int i;
+	for(i = 0; i < naxes; ++i){
+		axis_t *a = &axes[i];
+		unsigned int N = 0;
+		int dir;
+		if(a->qhead == a->qtail || a->leader || a->follower) continue;
+		while(a->qhead != a->qtail && !a->queue[a->qhead]) // skip empty moves
+			a->qhead = (a->qhead + 1) % MOTION_QLEN;
+		if(a->qhead == a->qtail) continue;
+		dir = (a->queue[a->qhead] > 0) ? 1 : -1;
+		if(a->running){
+			pthread_mutex_lock(&plan_mutex);
+			while(a->qhead != a->qtail && a->queue[a->qhead] * a->dir >= 0 && a->plan.stopat &&
+					a->steps + a->plan.ndec + JOIN_MARGIN < a->plan.stopat){
+				extend(a, labs(a->queue[a->qhead]));
+				a->qhead = (a->qhead + 1) % MOTION_QLEN;
+			}
+			pthread_mutex_unlock(&plan_mutex);
+			continue;
+		}
+		// lookahead: all moves in the same direction become one
+		while(a->qhead != a->qtail && a->queue[a->qhead] * dir >= 0){
+			N += labs(a->queue[a->qhead]);
+			a->qhead = (a->qhead + 1) % MOTION_QLEN;
+		}
+		axis_move(a, dir, N, a->profile.vmax);
+	}
+}
+
+/**
+ * Sleep while all axes are stopped (start() & motion_stop() wake it up)
+ */
+static void idle_wait(){
+	int i;
+	pthread_mutex_lock(&idle_mutex);
+	for(i = 0; i < naxes; ++i)
+		if(axes[i].running) break;
+	// flags are checked under mutex, so their signals can't be missed
+	if(i == naxes && !stopping) pthread_cond_wait(&idle_cond, &idle_mutex);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+/**
+ * Stop steppers' thread: motion_loop() returns (join its thread after this call)
+ */
+void motion_stop(){
+	pthread_mutex_lock(&idle_mutex);
+	stopping = 1;
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+/**
+ * Steppers' thread: sleep until nearest deadline of all axes & process it
+ * @param quit - flag to exit checked between pulses (NULL - none), idle thread
+ *              is woken up only by motion_stop()
+ */
+void motion_loop(const volatile int *quit){
+	struct timespec now, *nearest;
+	int i;
+	rt_setup_thread();
+	if(!pthread_getcpuclockid(pthread_self(), &cpuclock)) cpuclock_ok = 1;
+	while(!stopping && (!quit || !*quit)){
+		clock_now(&now);
+		nearest = NULL;
+		for(i = 0; i < naxes; ++i){
+			axis_t *a = &axes[i];
+			if(!__atomic_load_n(&a->running, __ATOMIC_ACQUIRE) || a->leader) continue;
+			if(a->restart){ // next motion starts right now
+				a->restart = 0;
+				a->next = now;
+				rate_reset(&a->meter, &now);
+			}
+			if(!nearest || ts_diff(&a->next, nearest) < 0) nearest = &a->next;
+		}
+		if(!nearest){
+			idle_wait();
+			continue;
+		}
+		// absolute deadlines don't accumulate errors of wakeups
+		wait_deadline(nearest);
+		clock_now(&now);
+		for(i = 0; i < naxes; ++i){
+			axis_t *a = &axes[i];
+			if(!a->running || a->leader || ts_diff(&now, &a->next) < 0) continue;
+			process(a, &now);
+		}
+	}
+}
+
+/**
+ * CPU usage of steppers' thread since previous call (main thread only)
+ * @return percents of one CPU or -1 if it's unknown
+ */
+double motion_cpu_usage(){
+	static struct timespec cpu0, t0;
+	struct timespec cpu, t;
+	double ret = -1.;
+	if(!cpuclock_ok || clock_gettime(cpuclock, &cpu)) return -1.;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if(t0.tv_sec && ts_diff(&t, &t0) > 0)
+		ret = 100. * ts_diff(&cpu, &cpu0) / ts_diff(&t, &t0);
+	cpu0 = cpu;
+	t0 = t;
+	return ret;
+}
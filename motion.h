@@ -0,0 +1,135 @@
+/*
+ * motion.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __MOTION_H__
+#define __MOTION_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "profile.h"
+#include "rtsched.h"
+
+// length of queue of moves
+#define MOTION_QLEN    (32)
+
+// drive modes
+#define DRIVE_STEPDIR  (0)  // driver with EN, DIR & CLK inputs, pulse by rising edge of CLK
+#define DRIVE_PHASES   (1)  // 4-wire motor, pulse is change of coils' phase
+
+// step modes of DRIVE_PHASES axis
+#define STEP_HALF      (0)  // one & two coils by turn: pulse is half-step
+#define STEP_FULL      (1)  // two coils: max torque, pulse is full step
+#define STEP_WAVE      (2)  // one coil: less power, pulse is full step
+
+// bits of end-switches
+#define LIMIT_BIT(dir) ((dir) > 0 ? 2 : 1) // 1 - at negative end, 2 - at positive
+
+// stages of homing
+#define HOMING_NONE     (0)
+#define HOMING_FAST     (1)  // fast approach to end-switch
+#define HOMING_BACKOFF  (2)  // move back until it's released
+#define HOMING_SLOW     (3)  // slow approach: position is zero where it's pressed
+#define HOMING_DONE     (4)
+#define HOMING_FAILED   (5)
+
+// plan of move: steppers' thread takes it as one unit between pulses
+typedef struct{
+	ramp_t *ramp;           // acceleration tables
+	unsigned int stopat;    // pulses to make (0 - infinite move)
+	unsigned int nacc, ndec;// amount of accelerating & decelerating pulses
+} move_plan;
+
+typedef struct axis_t axis_t;
+struct axis_t{
+	// configuration
+	char name;              // 'X', 'Y' etc - for messages
+	int drive;              // DRIVE_STEPDIR or DRIVE_PHASES
+	int pins[4];            // DRIVE_STEPDIR: EN, DIR, CLK; DRIVE_PHASES: A+, A-, B+, B-
+	int ppstep;             // pulses (microsteps or half-steps) per step
+	int stepmode;           // DRIVE_PHASES: STEP_HALF, STEP_FULL or STEP_WAVE
+	motion_profile profile; // speeds in steps per second, accel == 0 - constant speed
+	volatile int32_t *pos;  // storage of absolute position (pulses), NULL - don't track
+	// called by steppers' thread after each pulse, returns !0 to stop axis at once
+	int (*on_pulse)(axis_t *a, const struct timespec *now);
+	// called by steppers' thread when axis stops
+	void (*on_stop)(axis_t *a);
+	// current state
+	volatile int running;
+	volatile int dir;       // direction of current move: 1 or -1
+	volatile unsigned int steps;   // pulses made
+	unsigned int stopat;           // pulses to make (0 - infinite move)
+	volatile uint32_t period;            // current period of pulses, ns
+	rate_meter meter;
+	jitter_hist jitter;     // lateness of pulses
+	// internal data of engine
+	ramp_t ramps[2];        // acceleration tables: two buffers, active is ramp
+	ramp_t *ramp;           // plan used by steppers' thread
+	unsigned int nacc, ndec;// amount of accelerating & decelerating pulses
+	move_plan plan;         // last plan set by other threads (seqlock by plan_seq)
+	volatile unsigned int plan_seq, plan_used; // version of plan & version taken
+	volatile int restart;   // motor starts: reset its deadline
+	struct timespec next;   // deadline of next pulse (or edge)
+	int clk;                // level of CLK
+	int phase;              // current phase of coils
+	int phase_inc;          // change of phase by pulse: 1 for half-steps, 2 for full
+	uint32_t mask;          // mask of all axis' pins
+	uint32_t phase_set[8], phase_clr[8]; // DRIVE_PHASES: pins to set & clear for each phase
+	volatile int abort;     // stop at once
+	// end-switches (active low) by edge events
+	int limit_pin[2];       // at negative & positive ends
+	int limit_used;         // LIMIT_BIT of connected end-switches
+	volatile int limits;    // LIMIT_BIT of pressed end-switches (debounced)
+	// homing to end-switch
+	volatile int homing;    // stage HOMING_*
+	int home_dir, home_fast, home_slow;
+	unsigned int home_backoff;
+	// coordinated move: follower is stepped from leader by Bresenham's algorithm
+	axis_t * volatile follower;
+	axis_t * volatile leader; // not NULL if axis is a follower now
+	unsigned int bres_major, bres_minor;
+	long bres_err;
+	// queue of moves (signed amounts of pulses), it's filled & executed by main thread
+	long queue[MOTION_QLEN];
+	unsigned int qhead, qtail;
+};
+
+void motion_setup(axis_t *axes, int n);
+void motion_relax();
+int axis_move(axis_t *a, int dir, unsigned int N, int vmax);
+void axis_set_speed(axis_t *a, int vmax);
+void axis_soft_stop(axis_t *a);
+void axis_stop(axis_t *a);
+int axis_step_mode(axis_t *a, int mode);
+int axis_ppstep(const axis_t *a);
+int axis_limit(axis_t *a, int dir, int pin, unsigned int debounce_us);
+int axis_home(axis_t *a, int dir, int vfast, int vslow, unsigned int backoff);
+int axis_line(axis_t *a, axis_t *b, long da, long db);
+unsigned int axis_rate(axis_t *a, double *requested, double *achieved);
+int axis_queue(axis_t *a, long d);
+int axis_queue_end(axis_t *a, long *pos);
+void axis_flush(axis_t *a);
+void motion_poll();
+void motion_loop(const volatile int *quit);
+void motion_stop();
+double motion_cpu_usage();
+
+#endif // __MOTION_H__
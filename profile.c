@@ -0,0 +1,110 @@
+/*
+ * profile.c - tables of pulse periods for acceleration-limited moves
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <math.h>
+
+#include "profile.h"
+
+/**
+ * Fill periods of ramp from speed v0 to v1 with acceleration a
+ * (all in pulses per second)
+ * @param iv     - output array
+ * @param scurve - 0 - constant acceleration, 1 - S-curve (max acceleration == a)
+ * @return amount of pulses in ramp
+ */
+static unsigned int fill_ramp(uint32_t *iv, double v0, double v1, double a, int scurve){
+	unsigned int k;
+	double t, tprev = 0., T, dv = v1 - v0;
+	if(dv <= 0. || a <= 0.) return 0;
+	if(!scurve){
+		for(k = 1; k <= RAMP_MAX; ++k){
+			// x(t) = v0*t + a*t^2/2
+			if(v0*v0 + 2.*a*k >= v1*v1) break;
+			t = (sqrt(v0*v0 + 2.*a*k) - v0) / a;
+			iv[k-1] = (uint32_t)((t - tprev) * 1e9);
+			tprev = t;
+		}
+		return k - 1;
+	}
+	// v(t) = v0 + dv*(1-cos(pi*t/T))/2, max acceleration pi*dv/(2T) == a
+	T = M_PI * dv / (2. * a);
+	double xT = (v0 + dv/2.) * T; // path length of ramp
+	t = 0.;
+	for(k = 1; k <= RAMP_MAX && k < xT; ++k){
+		int i;
+		// solve x(t) == k by Newton's method, x(t) is monotonic
+		for(i = 0; i < 20; ++i){
+			double x = v0*t + dv/2. * (t - T/M_PI * sin(M_PI*t/T));
+			double v = v0 + dv/2. * (1. - cos(M_PI*t/T));
+			double dt = (k - x) / v;
+			t += dt;
+			if(fabs(dt) < 1e-9) break;
+		}
+		iv[k-1] = (uint32_t)((t - tprev) * 1e9);
+		tprev = t;
+	}
+	return k - 1;
+}
+
+/**
+ * Make acceleration & deceleration tables for given profile
+ * @param r      - output tables
+ * @param p      - profile parameters
+ * @param vmax   - max speed for this move (steps per second)
+ * @param ppstep - pulses per step (microstepping)
+ */
+void make_ramp(ramp_t *r, const motion_profile *p, int vmax, int ppstep){
+	double v0 = p->v0 * ppstep, v1 = vmax * ppstep;
+	if(v0 < 1.) v0 = 1.;
+	if(v1 < v0) v1 = v0;
+	r->cruise = (uint32_t)(1e9 / v1);
+	r->nacc = fill_ramp(r->acc, v0, v1, (double)p->accel * ppstep, p->scurve);
+	r->ndec = fill_ramp(r->dec, v0, v1, (double)p->decel * ppstep, p->scurve);
+	// ramps are too long for tables: don't jump to speed higher than reached by them
+	if(r->nacc == RAMP_MAX && r->acc[RAMP_MAX-1] > r->cruise) r->cruise = r->acc[RAMP_MAX-1];
+	if(r->ndec == RAMP_MAX && r->dec[RAMP_MAX-1] > r->cruise) r->cruise = r->dec[RAMP_MAX-1];
+}
+
+/**
+ * Calculate amount of accelerating & decelerating pulses for move of N pulses
+ * (if there's no room to reach max speed, split move in proportion of decel/accel)
+ * @param na, nd - output values
+ */
+void plan_move(const ramp_t *r, const motion_profile *p, unsigned int N,
+				unsigned int *na, unsigned int *nd){
+	unsigned int a = r->nacc, d = r->ndec;
+	if(N && a + d > N + 1){
+		a = (unsigned int)((uint64_t)N * p->decel / (p->accel + p->decel));
+		if(a > r->nacc) a = r->nacc;
+		d = N + 1 - a;
+		if(d > r->ndec) d = r->ndec;
+	}
+	*na = a; *nd = d;
+}
+
+/**
+ * Amount of pulses to stop motor moving with given pulse period
+ */
+unsigned int stop_length(const ramp_t *r, uint32_t period){
+	unsigned int i;
+	for(i = 0; i < r->ndec; ++i)
+		if(r->dec[i] <= period) break;
+	return i;
+}
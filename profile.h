@@ -0,0 +1,64 @@
+/*
+ * profile.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+
+// max length of acceleration/deceleration ramp (in pulses)
+#define RAMP_MAX   (4096)
+
+// parameters of motion profile (speeds in steps per second)
+typedef struct{
+	int v0;         // start/stop speed: can be reached without acceleration
+	int vmax;       // max (cruise) speed
+	int accel;      // acceleration, steps per second^2
+	int decel;      // deceleration, steps per second^2
+	int scurve;     // 1 - S-curve, 0 - trapezoidal
+} motion_profile;
+
+// precomputed periods of pulses (ns)
+typedef struct{
+	uint32_t acc[RAMP_MAX]; // acc[k] - period of k-th pulse from start
+	uint32_t dec[RAMP_MAX]; // dec[k] - period of pulse k pulses before stop
+	unsigned int nacc;      // length of acc[]
+	unsigned int ndec;      // length of dec[]
+	uint32_t cruise;        // period on max speed
+} ramp_t;
+
+void make_ramp(ramp_t *r, const motion_profile *p, int vmax, int ppstep);
+void plan_move(const ramp_t *r, const motion_profile *p, unsigned int N,
+				unsigned int *na, unsigned int *nd);
+unsigned int stop_length(const ramp_t *r, uint32_t period);
+
+/**
+ * Period of pulse number k for move of N pulses (N == 0 - infinite move)
+ * with na accelerating & nd decelerating pulses
+ */
+static inline uint32_t ramp_period(const ramp_t *r, unsigned int k, unsigned int N,
+				unsigned int na, unsigned int nd){
+	if(k < na) return r->acc[k];
+	if(N && k <= N && N - k < nd) return r->dec[N - k];
+	return r->cruise;
+}
+
+#endif // __PROFILE_H__
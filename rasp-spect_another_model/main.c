@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <syslog.h>
 
 #include <signal.h>
@@ -42,12 +43,20 @@
 #include <sys/prctl.h>
 
 #include <pthread.h>
+#include <poll.h>
 
 #include <sys/reboot.h>
 
 #include "stepper.h"
 #include "dbg.h"
 #include "que.h"
+#include "telemetry.h"
+#include "rtsched.h"
+#include "gpio.h"
+#include "seq.h"
+#include "assets.h"
+#include "reactor.h"
+#include "state.h"
 
 #define MESSAGE_QUEUE_SIZE 3
 
@@ -65,10 +74,7 @@ typedef struct{
 char *client_IP = NULL; // IP of first connected client
 
 per_session_data global_queue;
-pthread_mutex_t command_mutex, ip_mutex;
-
-char cmd_buf[CMDBUFLEN] = {0};
-volatile int data_in_buf = 0; // signals that there's some data in cmd_buf to send to motors
+pthread_mutex_t ip_mutex;
 
 char que[CMDBUFLEN];
 
@@ -182,11 +188,45 @@ volatile int force_exit = 0;
  *
  * Sxxx - set steppers speed to xxx
  * G - get steppers speed
+ * Txx - set telemetry rate to xx records per second (0 - only events)
+ * R - get requested & achieved step rate
+ * J - get lateness of half-steps (us) & CPU usage of steppers' thread
+ * J0 - clear lateness statistics
+ * Mm - set step mode: m is 'h' (half-steps), 'f' (full steps, max torque) or 'w' (wave, one coil)
+ * M - get step mode
+ * Qname=steps - define sequence, steps are separated by ';':
+ *     Ln+/Ln- - lamp n on/off, L0 - all off, X+n/X-n - move to n steps,
+ *     Wn - wait n ms, Cn - capture (hold all for n ms of exposure)
+ * Qname - run sequence (progress is sent by telemetry), Q0 - stop it, Q - list of sequences
+ * B - get amount of restarts & time from last (re)start to ready state
  */
+static void process_seq(char *command){
+	char seqs[5 + SEQ_MAX * SEQ_NAMELEN];
+	int ret;
+	if(!command[1]){
+		memcpy(seqs, "seqs=", 5);
+		seq_list(seqs + 5, sizeof(seqs) - 5);
+		glob_que(seqs);
+	}else if(!strcmp(&command[1], "0")){
+		seq_stop();
+	}else if(strchr(command, '=')){
+		if((ret = seq_define(&command[1])))
+			GLOB_MESG((ret == 1) ? "Too much sequences" : "Wrong sequence");
+	}else if((ret = seq_run(&command[1])))
+		GLOB_MESG((ret == 1) ? "Sequence is running" : "No such sequence");
+}
+
 void process_buf(char *command){
-	int dir = 0, nlamp = 0;
+	int dir = 0, nlamp = 0, ret;
 	long X;
+	double req, ach;
+	unsigned int missed;
+	jitter_stat jit;
 	void (*moveFN)(int, unsigned int) = NULL;
+	if(command[0] == 'Q'){ // name of sequence can begin with any letter
+		process_seq(command);
+		return;
+	}
 	switch (command[1]){
 		case 'X':
 			moveFN = Xmove;
@@ -197,6 +237,7 @@ void process_buf(char *command){
 		break;
 		case '0': // turn off
 			if(command[0] == 'D'){
+				seq_stop();
 				move_motor(0);
 				set_lamp(1, 0);
 				set_lamp(2, 0);
@@ -213,6 +254,12 @@ void process_buf(char *command){
 			dir = -1;
 		break;
 	}
+	// while sequence runs, motor & lamps are driven only by it (queries are allowed)
+	if(seq_running() && ((command[0] == 'D' && (moveFN || nlamp)) ||
+			(command[0] == 'M' && command[1]) || command[0] == 'S')){
+		GLOB_MESG("Sequence is running");
+		return;
+	}
 	switch (command[0]){
 		case 'S': // change current speed
 			X = strtol(&command[1], NULL, 10);
@@ -221,12 +268,42 @@ void process_buf(char *command){
 		case 'G': // get speed - send to client the value of current speed
 			GLOB_MESG("curspd=%d", get_motors_speed());
 		break;
+		case 'T': // change telemetry rate
+			X = strtol(&command[1], NULL, 10);
+			telemetry_set_rate((int)X);
+			GLOB_MESG("telrate=%d", telemetry_get_rate());
+		break;
+		case 'R': // get step rate: requested/achieved & missed deadlines
+			missed = get_step_rate(&req, &ach);
+			GLOB_MESG("rate=%.1f/%.1f missed=%u", ach, req, missed);
+		break;
+		case 'J': // jitter of half-steps
+			if(command[1] == '0'){
+				clear_jitter();
+				break;
+			}
+			get_jitter(&jit);
+			GLOB_MESG("jitter n=%u min=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f us "
+				"missed=%u cpu=%.1f%%", jit.count, jit.min, jit.p50, jit.p90, jit.p99, jit.p999,
+				jit.max, jit.missed, get_steppers_cpu());
+		break;
+		case 'M': // step mode
+			if(command[1] && (ret = set_step_mode(command[1]))){
+				GLOB_MESG((ret == 1) ? "Stop motor first" : "Wrong step mode");
+				break;
+			}
+			GLOB_MESG("mode=%c", get_step_mode());
+		break;
 		case 'E': // get end-switches
 			GLOB_MESG("esw=%d", get_endsw());
 		break;
 		case 'L': // get lamp state
 			GLOB_MESG("lamps=%d", getlamp());
 		break;
+		case 'B': // restarts
+			if(!state_get()) break;
+			GLOB_MESG("restarts=%u ready=%.1fms", state_get()->restarts, state_get()->ready / 1e6);
+		break;
 		case 'D': // button pressed
 			if(moveFN){
 				moveFN(dir, 0); // move infinitely when button pressed
@@ -247,6 +324,8 @@ void process_buf(char *command){
 	}
 }
 
+static void after_events();
+
 #define MESG(X) do{if(dat) put_message_to_queue(X, dat);}while(0)
 void websig(char *command, per_session_data *dat){
 	size_t L;
@@ -259,7 +338,8 @@ void websig(char *command, per_session_data *dat){
 		MESG("Change speed");
 		goto ret;
 	}
-	if(command[0] == 'G' || command[0] == 'E' || command[0] == 'L'){ // get speed
+	if(command[0] == 'G' || command[0] == 'E' || command[0] == 'L' || command[0] == 'T' ||
+			command[0] == 'R' || command[0] == 'J' || command[0] == 'M' || command[0] == 'Q' || command[0] == 'B'){
 		goto ret;
 	}
 	if(command[0] != 'D' && command[0] != 'U'){
@@ -303,11 +383,8 @@ void websig(char *command, per_session_data *dat){
 		return;
 	}
 ret:
-	while(data_in_buf); // wait for execution of last command
-	pthread_mutex_lock(&command_mutex);
-	strncpy(cmd_buf, command, CMDBUFLEN);
-	data_in_buf = 1;
-	pthread_mutex_unlock(&command_mutex);
+	process_buf(command); // commands are executed by reactor at once
+	after_events();
 }
 
 static void dump_handshake_info(struct libwebsocket *wsi){
@@ -381,6 +458,36 @@ static void dump_handshake_info(struct libwebsocket *wsi){
 	}
 }
 
+/**
+ * Events on socket of websockets
+ */
+static struct libwebsocket_context *ws_context = NULL;
+static void lws_service(int fd, int revents, _U_ void *arg){
+	struct pollfd pfd = {fd, (short)revents, (short)revents};
+	if(ws_context) libwebsocket_service_fd(ws_context, &pfd);
+}
+
+/**
+ * HTTP requests: files of web-interface
+ * @return -1 to close connection
+ */
+static int serve_http(struct libwebsocket *wsi, const char *uri){
+	static const char *notfound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	char inm[128], ae[128], buf[256];
+	asset_reply r;
+	int have_inm = 0, have_ae = 0;
+	if(lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0 &&
+		lws_hdr_copy(wsi, inm, sizeof(inm), WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0) have_inm = 1;
+	if(lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0 &&
+		lws_hdr_copy(wsi, ae, sizeof(ae), WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0) have_ae = 1;
+	if(!uri || assets_reply(uri, have_inm ? inm : NULL, have_ae ? ae : NULL, &r, buf, sizeof(buf)))
+		libwebsocket_write(wsi, (unsigned char*)notfound, strlen(notfound), LWS_WRITE_HTTP);
+	else
+		libwebsocket_write(wsi, (unsigned char*)r.data, r.len, LWS_WRITE_HTTP);
+	return -1;
+}
+
 /*
 reasons:
 0         LWS_CALLBACK_ESTABLISHED,
@@ -434,6 +541,7 @@ static int my_protocol_callback(struct libwebsocket_context *context,
 	char client_ip[128];
 	char *M, *msg = (char*) in;
 	per_session_data *dat = (per_session_data *) user;
+	struct libwebsocket_pollargs *pa = (struct libwebsocket_pollargs *) in;
 	int L, W;
 	void sendmsg(char *M){
 		L = strlen(M);
@@ -448,16 +556,42 @@ static int my_protocol_callback(struct libwebsocket_context *context,
 			sendmsg(M);
 		}
 	}
+	// format telemetry records only here, in websockets' thread
+	// drain ring while socket accepts data
+	inline void parse_telemetry(){
+		telemetry_rec r;
+		char tbuf[MESSAGE_LEN];
+		int part, n = 0;
+		// ring can't give more than its size between two calls
+		while(n++ < TELEMETRY_RING_SIZE && !lws_send_pipe_choked(wsi)){
+			if(!telemetry_pop(&r)) break;
+			for(part = 0; telemetry_format(&r, part, tbuf, MESSAGE_LEN); ++part)
+				sendmsg(tbuf);
+		}
+	}
 	//DBG("my proto. reason: %d\n", reason);
 	switch (reason) {
+		// sockets are watched by reactor
+		case LWS_CALLBACK_ADD_POLL_FD:
+			reactor_add(pa->fd, pa->events, lws_service, NULL);
+		break;
+		case LWS_CALLBACK_DEL_POLL_FD:
+			reactor_del(pa->fd);
+		break;
+		case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+			reactor_mod(pa->fd, pa->events);
+		break;
+		case LWS_CALLBACK_HTTP:
+			return serve_http(wsi, msg);
 		case LWS_CALLBACK_ESTABLISHED:
 			memset(dat, 0, sizeof(per_session_data));
 			pthread_mutex_lock(&ip_mutex);
 			libwebsockets_get_peer_addresses(context, wsi, libwebsocket_get_socket_fd(wsi),
 				client_name, 127, client_ip, 127);
-			if(!client_IP)
+			if(!client_IP){
 				client_IP = strdup(client_ip);
-			else if(strcmp(client_IP, client_ip)){
+				telemetry_flush(); // don't send old records to new client
+			}else if(strcmp(client_IP, client_ip)){
 				char buf[256];
 				snprintf(buf, 255, "Already connected from %s.<br>Please, disconnect.", client_IP);
 				DBG("Already connected\n");
@@ -470,19 +604,19 @@ static int my_protocol_callback(struct libwebsocket_context *context,
 			libwebsocket_callback_on_writable(context, wsi);
 		break;
 		case LWS_CALLBACK_SERVER_WRITEABLE:
-			if(dat->num || global_queue.num){
-				parse_queue_msg(dat);
-				if(!dat->already_connected)
-					parse_queue_msg(&global_queue);
-			}else{
-				usleep(500);
-			}
-			libwebsocket_callback_on_writable(context, wsi);
-			return 0;
+			if(!dat->already_connected)
+				parse_telemetry();
+			parse_queue_msg(dat);
+			if(!dat->already_connected)
+				parse_queue_msg(&global_queue);
+			// when there's nothing more, new records wake reactor by telemetry_notify()
+			if(dat->num || (!dat->already_connected && (global_queue.num || telemetry_pending())))
+				libwebsocket_callback_on_writable(context, wsi);
 		break;
 		case LWS_CALLBACK_RECEIVE:
 			if(!dat->already_connected)
 				websig(msg, dat);
+			if(dat->num) libwebsocket_callback_on_writable(context, wsi);
 			//DBG("got message: %s\n", msg);
 			//else return -1;
 		break;
@@ -529,25 +663,41 @@ static struct libwebsocket_protocols protocols[] = {
 //**************************************************************************//
 void sighandler(_U_ int sig){
 	force_exit = 1;
+	reactor_wake();
 	printf("Exit\n");
 }
 
-void *websock_thread(_U_ void *buf){
-	DBG("websock_thread");
+/**
+ * Things to do after commands: send messages
+ */
+static void after_events(){
+	if(ws_context && global_queue.num)
+		libwebsocket_callback_on_writable_all_protocol(&protocols[0]);
+}
+
+/**
+ * Wakeup by steppers' or sequences' thread: there are telemetry records
+ */
+static void on_wake(){
+	if(ws_context) libwebsocket_callback_on_writable_all_protocol(&protocols[0]);
+}
+
+/**
+ * Periodic servicing of websockets' timeouts
+ */
+static void lws_timer(_U_ int fd, _U_ int revents, _U_ void *arg){
+	if(ws_context) libwebsocket_service_fd(ws_context, NULL);
+}
+
+static struct libwebsocket_context *websock_init(){
+	DBG("websock_init");
 	struct libwebsocket_context *context;
-	int n = 0;
 	int opts = 0;
 	const char *iface = NULL;
 	//int syslog_options = LOG_PID | LOG_PERROR;
-	//unsigned int oldus = 0;
 	struct lws_context_creation_info info;
 	//int debug_level = 7;
 
-	if(pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL)){
-		force_exit = 1;
-		return NULL;
-	}
-
 	memset(&info, 0, sizeof info);
 	info.port = 9999;
 
@@ -568,86 +718,108 @@ void *websock_thread(_U_ void *buf){
 	info.uid = -1;
 	info.options = opts;
 
+	// sockets are added to reactor by LWS_CALLBACK_ADD_POLL_FD
 	context = libwebsocket_create_context(&info);
 	if (context == NULL){
 		lwsl_err("libwebsocket init failed\n");
-		force_exit = 1;
 		return NULL;
 	}
-	//int oldms = 0;
-	while(n >= 0 && !force_exit){
-		//struct timeval tv;
-		//gettimeofday(&tv, NULL);
-		//int ms = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-		//if((ms - oldms) > 50){
-		//	libwebsocket_callback_on_writable_all_protocol(protocols);
-		//	oldms = ms;
-		//}
-		n = libwebsocket_service(context, 50);
-	}//while n>=0
-	libwebsocket_context_destroy(context);
-	lwsl_notice("libwebsockets-test-server exited cleanly\n");
-	closelog();
-	DBG("return webs_thre");
-	return NULL;
+	return context;
 }
 
-//#if 0
+/**
+ * Main thread of child: reactor serves websockets, commands & telemetry of other threads
+ */
 static inline void main_proc(){
 	DBG("main proc");
-	pthread_t s_thread, w_thread;
-	pthread_create(&w_thread, NULL, websock_thread, NULL);
-	pthread_create(&s_thread, NULL, steppers_thread, NULL);
+	pthread_t s_thread;
 	setup_pins();
-//    int i = 0, j = 1;
-	while(!force_exit){
-/*		if(++i == 1000){
-			i = 0;
-			Xmove(j, 50);
-			j = (j > 0) ? -1 : 1;
-		}
-*/
-		pthread_mutex_lock(&command_mutex);
-		if(data_in_buf) process_buf(cmd_buf);
-		data_in_buf = 0;
-		pthread_mutex_unlock(&command_mutex);
-		usleep(1000); // give another treads some time to fill buffer
-	} 
+	if(reactor_init(on_wake) || !(ws_context = websock_init()) || reactor_timer(1000, lws_timer, NULL)){
+		force_exit = 1;
+		return;
+	}
+	telemetry_notify(reactor_wake);
+	pthread_create(&s_thread, NULL, steppers_thread, NULL);
+	seq_resume(); // sequence interrupted by death of previous child
+	state_ready();
+
+	reactor_run(&force_exit);
+
 	DBG("stop threads");
-	pthread_cancel(s_thread); // cancel steppers' thread
-	pthread_cancel(w_thread);
+	seq_stop();
+	steppers_stop();
 	stop_motor();
 	set_lamp(1, 0);
 	set_lamp(2, 0);
 	DBG("wait s_tr");
 	pthread_join(s_thread, NULL);
-	DBG("wait w_tr");
-	pthread_join(w_thread, NULL); // wait for closing of libsockets thread
+	telemetry_notify(NULL);
+	libwebsocket_context_destroy(ws_context);
+	ws_context = NULL;
+	lwsl_notice("libwebsockets-test-server exited cleanly\n");
 	DBG("return main_proc");
 }
-//#endif
-/*
-static inline void main_proc(){
-    pthread_t s_thread;
-    pthread_create(&s_thread, NULL, steppers_thread, NULL);
-    setup_pins();
-    Xmove(-1, 100);
-    pthread_join(s_thread, NULL);
+
+static void usage(char *name){
+	printf("Usage: %s [-p prio] [-c cpu] [-m] [-s] [-v]\n", name);
+	printf("\t-p prio - run steppers' thread with SCHED_FIFO priority prio\n");
+	printf("\t-c cpu  - pin steppers' thread to CPU cpu\n");
+	printf("\t-m      - lock all memory (mlockall)\n");
+	printf("\t-s      - simulate GPIO & motors (always on PC)\n");
+	printf("\t-v      - virtual time for simulation (motors run as fast as possible)\n");
+	exit(1);
 }
-*/
 
 //**************************************************************************//
-int main(_U_ int argc, _U_ char **argv){
+int main(int argc, char **argv){
+	int opt;
+	while((opt = getopt(argc, argv, "p:c:msvh")) != -1){
+		switch(opt){
+			case 'p':
+				rtparams.priority = atoi(optarg);
+			break;
+			case 'c':
+				rtparams.cpu = atoi(optarg);
+			break;
+			case 'm':
+				rtparams.memlock = 1;
+			break;
+			case 's':
+				gpio_simulate = 1;
+			break;
+			case 'v':
+				rtparams.virtime = 1;
+			break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if(rtparams.virtime && !gpio_simulate){
+		fprintf(stderr, "Virtual time can be used only with simulation\n");
+		rtparams.virtime = 0;
+	}
 	signal(SIGTERM, sighandler);	// kill (-15)
 	signal(SIGINT, sighandler);		// ctrl+C
 	signal(SIGQUIT, SIG_IGN);		// ctrl+\  .
 	signal(SIGTSTP, SIG_IGN);		// ctrl+Z
+	// state & web-interface are kept by supervisor
+	steppers_open_state();
+	state_cold();
+	if(assets_load(ASSETS_DIR))
+		fprintf(stderr, "Not all files of web-interface are loaded from " ASSETS_DIR "\n");
 	while(1){
 		if(force_exit) return 0;
+		state_start();
+		fflush(stdout); // don't duplicate buffered output in child
 		pid_t childpid = fork();
+		if(childpid < 0){
+			perror("fork()");
+			sleep(1); // don't try again at once (signal interrupts it)
+			continue;
+		}
 		if(childpid){
 			printf("Created child with PID %d\n", childpid);
-			wait(NULL);
+			while(waitpid(childpid, NULL, 0) < 0 && errno == EINTR);
 			printf("Child %d died\n", childpid);
 		}else{
 			prctl(PR_SET_PDEATHSIG, SIGTERM); // send SIGTERM to child when parent dies
@@ -0,0 +1,349 @@
+/*
+ * seq.c - sequences of lamps', motor's, wait & capture steps (e.g. for calibration),
+ *         executed by separate thread with timing by absolute deadlines
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "seq.h"
+#include "stepper.h"
+#include "telemetry.h"
+#include "rtsched.h"
+#include "state.h"
+#include "dbg.h"
+
+// sequence is written as "name=step;step;...", steps are:
+// Ln+, Ln- - turn lamp n on/off, L0 - all lamps off
+// X+n, X-n - move motor to n steps & wait until it stops
+// Wn       - wait n milliseconds
+// Cn       - capture: hold all still for n milliseconds of exposure
+#define BUILTIN  "calib=L1+;X+100;W500;C1000;L2+;W500;C1000;L0"
+
+typedef struct{
+	char op;    // 'L', 'X', 'W' or 'C'
+	long arg;   // number of lamp, steps or milliseconds
+	int on;     // lamp state
+} seq_step;
+
+typedef struct{
+	char name[SEQ_NAMELEN];
+	int nsteps;
+	seq_step steps[SEQ_MAXSTEPS];
+} sequence;
+
+static sequence seqs[SEQ_MAX];
+static int nseqs = 0;
+static sequence job; // copy of running sequence
+static int first = 0; // step to start job from (> 0 after restart)
+static volatile int running = 0, stopseq = 0;
+// sequence thread sleeps on it until deadline (CLOCK_MONOTONIC) or stop
+static pthread_mutex_t seq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seq_cond;
+static int seq_cond_ok = 0;
+
+/**
+ * Parse one step
+ * @return pointer to next symbol after step or NULL if error
+ */
+static const char *parse_step(const char *s, seq_step *st){
+	char *eptr;
+	st->op = *s++;
+	st->on = 0;
+	switch(st->op){
+		case 'L':
+			if(*s == '0'){
+				st->arg = 0;
+				return s + 1;
+			}
+			if((*s != '1' && *s != '2') || (s[1] != '+' && s[1] != '-')) return NULL;
+			st->arg = *s - '0';
+			st->on = (s[1] == '+');
+			return s + 2;
+		case 'X':
+			if(*s != '+' && *s != '-') return NULL;
+			st->arg = strtol(s, &eptr, 10);
+			if(eptr == s || !st->arg) return NULL;
+			return eptr;
+		case 'W':
+		case 'C':
+			st->arg = strtol(s, &eptr, 10);
+			if(eptr == s || st->arg < 0) return NULL;
+			return eptr;
+	}
+	return NULL;
+}
+
+static void builtin(){
+	static int done = 0;
+	if(done) return;
+	done = 1;
+	seq_define(BUILTIN);
+}
+
+static sequence *find(const char *name){
+	int i;
+	for(i = 0; i < nseqs; ++i)
+		if(!strcmp(seqs[i].name, name)) return &seqs[i];
+	return NULL;
+}
+
+/**
+ * Define (or redefine) sequence
+ * @param def - "name=step;step;..."
+ * @return 0 if all OK, 1 if there's too much sequences, 2 if syntax error
+ */
+int seq_define(const char *def){
+	sequence s;
+	sequence *old;
+	const char *p = strchr(def, '=');
+	size_t L = p ? (size_t)(p - def) : 0;
+	builtin();
+	if(!L || L >= SEQ_NAMELEN) return 2;
+	memset(&s, 0, sizeof(s));
+	memcpy(s.name, def, L);
+	for(++p; *p; ){
+		if(s.nsteps == SEQ_MAXSTEPS || !(p = parse_step(p, &s.steps[s.nsteps]))) return 2;
+		++s.nsteps;
+		if(*p == ';') ++p;
+		else if(*p) return 2;
+	}
+	if(!s.nsteps) return 2;
+	if(!(old = find(s.name))){
+		if(nseqs == SEQ_MAX) return 1;
+		old = &seqs[nseqs++];
+	}
+	*old = s;
+	DBG("sequence %s: %d steps", s.name, s.nsteps);
+	return 0;
+}
+
+/**
+ * Names of all sequences separated by commas
+ */
+void seq_list(char *buf, size_t len){
+	int i;
+	size_t L = 0;
+	builtin();
+	*buf = 0;
+	for(i = 0; i < nseqs && L < len; ++i)
+		L += snprintf(buf + L, len - L, "%s%s", i ? "," : "", seqs[i].name);
+}
+
+/**
+ * Hash of sequence, so restarted child resumes it only if it's the same
+ */
+static int32_t seq_hash(const sequence *s){
+	const uint8_t *p = (const uint8_t *)s;
+	uint32_t h = 2166136261U; // FNV-1a
+	size_t i;
+	for(i = 0; i < sizeof(sequence); ++i) h = (h ^ p[i]) * 16777619U;
+	return (int32_t)h;
+}
+
+/**
+ * Store running sequence in shared state: args are its index, hash & amount of steps,
+ * done is number of current step
+ */
+static void job_save(int idx){
+	motion_state *st = state_get();
+	if(!st) return;
+	state_job j = {STATE_JOB_SEQ, {idx, seq_hash(&seqs[idx]), seqs[idx].nsteps, 0}, 0, 0};
+	st->job = j;
+}
+
+/**
+ * Step is started: restarted child will begin from it
+ */
+static void job_progress(int step){
+	motion_state *st = state_get();
+	if(!st) return;
+	st->job.done = step;
+	st->job.tries = 0;
+}
+
+static void job_clear(){
+	motion_state *st = state_get();
+	if(st) st->job.type = STATE_JOB_NONE;
+}
+
+static void report(uint16_t event, int step, int aborted){
+	telemetry_rec r = {telemetry_time(), step, aborted, 0, event,
+		(event & TELEM_EV_SEQSTEP) ? job.steps[step].op : 0, job.nsteps};
+	telemetry_push_seq(&r);
+}
+
+/**
+ * Sleep until absolute deadline (seq_stop() wakes it at once)
+ * @return 1 if sequence is stopped
+ */
+static int sleep_until(const struct timespec *deadline){
+	pthread_mutex_lock(&seq_mutex);
+	while(!stopseq && pthread_cond_timedwait(&seq_cond, &seq_mutex, deadline) != ETIMEDOUT);
+	pthread_mutex_unlock(&seq_mutex);
+	return stopseq;
+}
+
+/**
+ * Move motor & wait until it stops (seq_stop() wakes it at once)
+ * @return 1 if sequence is stopped or motor is stopped by end-switch
+ */
+static int move(long N){
+	int dir = (N > 0) ? 1 : -1;
+	Xmove(dir, (unsigned int)labs(N));
+	if(wait_motor_stop(&stopseq)){
+		stop_motor();
+		return 1;
+	}
+	return (get_endsw() & ((dir > 0) ? 2 : 1)) ? 1 : 0;
+}
+
+static void *seq_thread(_U_ void *arg){
+	struct timespec t;
+	int i, ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for(i = first; i < job.nsteps && !ret && !stopseq; ++i){
+		seq_step *s = &job.steps[i];
+		if(i > first) job_progress(i); // resumed step doesn't reset tries
+		report(TELEM_EV_SEQSTEP, i, 0);
+		switch(s->op){
+			case 'L':
+				if(s->arg) set_lamp((int)s->arg, s->on);
+				else{
+					set_lamp(1, 0);
+					set_lamp(2, 0);
+				}
+			break;
+			case 'X':
+				ret = move(s->arg);
+				clock_gettime(CLOCK_MONOTONIC, &t); // timing continues from motor stop
+			break;
+			case 'W':
+			case 'C':
+				// deadlines are counted from previous ones, so delays don't accumulate
+				ts_add(&t, s->arg * 1000000L);
+				ret = sleep_until(&t);
+			break;
+		}
+	}
+	ret |= stopseq;
+	if(ret){ // leave all safe
+		stop_motor();
+		set_lamp(1, 0);
+		set_lamp(2, 0);
+	}
+	job_clear();
+	report(TELEM_EV_SEQEND, i, ret);
+	DBG("sequence %s %s at step %d", job.name, ret ? "aborted" : "done", i);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * Start thread of sequence seqs[idx] from step "from"
+ * @return 0 if all OK
+ */
+static int start(int idx, int from){
+	pthread_t thread;
+	pthread_condattr_t attr;
+	if(!seq_cond_ok){
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		seq_cond_ok = !pthread_cond_init(&seq_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		if(!seq_cond_ok) return 1;
+	}
+	job = seqs[idx];
+	first = from;
+	stopseq = 0;
+	running = 1;
+	if(pthread_create(&thread, NULL, seq_thread, NULL)){
+		perror("pthread_create()");
+		job_clear();
+		running = 0;
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/**
+ * Run sequence by its name
+ * @return 0 if all OK, 1 if other sequence is running, 2 if there's no such sequence
+ */
+int seq_run(const char *name){
+	sequence *s;
+	builtin();
+	if(running) return 1;
+	if(!(s = find(name))) return 2;
+	job_save(s - seqs);
+	return start(s - seqs, 0);
+}
+
+/**
+ * Resume sequence interrupted by death of previous child from its interrupted step;
+ * sequence is aborted (lamps are turned off) if it was moving motor (its position
+ * is unknown), if it isn't defined after restart or if it fails again & again
+ * @return 0 if sequence is resumed, 1 if there's no sequence or it's aborted
+ */
+int seq_resume(){
+	motion_state *st = state_get();
+	state_job *j;
+	int idx, step;
+	builtin();
+	if(!st || running || (j = &st->job)->type != STATE_JOB_SEQ) return 1;
+	idx = j->args[0];
+	step = j->done;
+	if(++j->tries <= STATE_JOB_TRIES && idx >= 0 && idx < nseqs && j->args[1] == seq_hash(&seqs[idx])
+			&& step >= 0 && step < seqs[idx].nsteps && seqs[idx].steps[step].op != 'X'){
+		printf("Resume sequence %s from step %d\n", seqs[idx].name, step);
+		if(!start(idx, step)) return 0;
+	}
+	fprintf(stderr, "Sequence interrupted by restart at step %d is aborted\n", step);
+	job_clear();
+	memset(&job, 0, sizeof(job));
+	job.nsteps = j->args[2];
+	stop_motor();
+	set_lamp(1, 0);
+	set_lamp(2, 0);
+	report(TELEM_EV_SEQEND, step, 1);
+	return 1;
+}
+
+/**
+ * Stop running sequence (motor is stopped & lamps are turned off)
+ */
+void seq_stop(){
+	pthread_mutex_lock(&seq_mutex);
+	stopseq = 1;
+	if(seq_cond_ok) pthread_cond_broadcast(&seq_cond);
+	pthread_mutex_unlock(&seq_mutex);
+	steppers_wake(); // sequence can wait for motor
+}
+
+/**
+ * @return !0 if sequence is running
+ */
+int seq_running(){
+	return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
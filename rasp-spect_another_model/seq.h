@@ -0,0 +1,39 @@
+/*
+ * seq.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __SEQ_H__
+#define __SEQ_H__
+
+#include <stddef.h>
+
+// max amount of sequences, their steps & length of names
+#define SEQ_MAX       (8)
+#define SEQ_MAXSTEPS  (32)
+#define SEQ_NAMELEN   (16)
+
+int seq_define(const char *def);
+int seq_run(const char *name);
+int seq_resume();
+void seq_stop();
+int seq_running();
+void seq_list(char *buf, size_t len);
+
+#endif // __SEQ_H__
@@ -1,5 +1,5 @@
 /*
- * stepper.c - functions for working with stepper motors by wiringPi
+ * stepper.c - functions for working with stepper motors through GPIO
  *
  * Copyright 2015 Edward V. Emelianoff <eddy@sao.ru>
  *
@@ -24,205 +24,253 @@
 #include <time.h>			// time
 #include <string.h>			// memcpy
 #include <stdint.h>			// int types
-#include <sys/time.h>		// gettimeofday
 #define X_OPEN_SOURCE 999
 #include <unistd.h>			// usleep
-// use wiringPi on ARM & simple echo on PC (for tests)
-#ifdef __arm__
-	#include <wiringPi.h>
-#endif
+#include <pthread.h>
 
 #include "stepper.h"
 #include "dbg.h"
 #include "que.h"
+#include "telemetry.h"
+#include "rtsched.h"
+#include "gpio.h"
+#include "motion.h"
+#include "state.h"
 
-#ifdef __arm__
-/**
- * function for different purposes that need to know time intervals
- * @return double value: time in seconds
- */
-static double dtime(){
-	double t;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	t = tv.tv_sec + ((double)tv.tv_usec)/1e6;
-	return t;
-}
+// half-steps per step (full cycle of coils' phases)
+#define PPSTEP  (8)
+// pulses per step in current step mode
+#define PPS()   axis_ppstep(&motor)
 
-void Write(int pin, int val){
-	if(val) val = 1;
-	digitalWrite(pin, val);
-	while(digitalRead(pin) != val);
-}
-#endif // __arm__
+// simulated motor: full range, end-switches positions (in steps) & max speed
+#define SIM_RANGE     (2000)
+#define SIM_ESWPOS    (20)
+#define SIM_MAXRATE   (250)
 
+// end-switch should hold its level for this time (us)
+#define ESW_DEBOUNCE  (5000)
 
-#ifdef __arm__
-// arrays for full & half stepping (signal level for corresponding pin)
-// {MOTOR_PIN1, MOTOR_PIN2, MOTOR_PIN3, MOTOR_PIN4}
-/*
-const int steps_full[][4] = {
-	{1, 0, 0, 1},
-	{1, 0, 1, 0},
-	{0, 1, 1, 0},
-	{0, 1, 0, 1}
-};
-*/
+volatile int stepspersec = 150;
 
-const int steps_full[][4] = {
-	{1, 0, 0, 1},
-	{1, 0, 1, 0},
-	{0, 1, 1, 0},
-	{0, 1, 0, 1}
-};
+static int on_pulse(axis_t *a, const struct timespec *now);
+static void on_stop(axis_t *a);
+// threads waiting for stop of motor
+static pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
 
-/*
-const int steps_half[][4] = {
-	{0, 1, 0, 1},
-	{0, 1, 0, 0},
-	{0, 1, 1, 0},
-	{0, 0, 1, 0},
-	{1, 0, 1, 0},
-	{1, 0, 0, 0},
-	{1, 0, 0, 1},
-	{0, 0, 0, 1}
-};
-*/
+// 4-wire motor without acceleration
+static axis_t motor = {.name = 'X', .drive = DRIVE_PHASES,
+	.pins = {MOTOR_PIN1, MOTOR_PIN2, MOTOR_PIN3, MOTOR_PIN4}, .ppstep = PPSTEP,
+	.profile = {150, 150, 0, 0, 0}, .on_pulse = on_pulse, .on_stop = on_stop};
 
-const int steps_half[][4] = {
-	{1, 0, 0, 1},
-	{1, 0, 1, 1},
-	{1, 0, 1, 0},
-	{1, 1, 1, 0},
-	{0, 1, 1, 0},
-	{0, 1, 1, 1},
-	{0, 1, 0, 1},
-	{1, 1, 0, 1}
-};
+static int simmotor = -1;
+static motion_state *state = NULL;
+static motion_state nostate; // used if state file can't be mapped
+/**
+ * Add simulated motor (half-steps units) with end-switches near its mechanical limits
+ */
+static void setup_simulation(){
+	sim_motor m = {SIM_PHASES, {MOTOR_PIN1, MOTOR_PIN2, MOTOR_PIN3, MOTOR_PIN4},
+		SIM_RANGE*4, 0, SIM_RANGE*8, {ESW1_PIN, ESW2_PIN},
+		{SIM_ESWPOS*8, (SIM_RANGE-SIM_ESWPOS)*8}, SIM_MAXRATE*8, 0, 0, 0};
+	simmotor = sim_add_motor(&m);
+}
 
-/*
-const int steps_half[][4] = {
-	{0, 1, 1, 0},
-	{0, 1, 1, 1},
-	{0, 1, 0, 1},
-	{1, 1, 0, 1},
-	{1, 0, 0, 1},
-	{1, 0, 1, 1},
-	{1, 0, 1, 0},
-	{1, 1, 1, 0}
-};
-*/
-#endif // __arm__
+/**
+ * Show position of simulated motor when it stops
+ */
+static void sim_stopped(){
+	sim_motor m;
+	if(!gpio_simulate || sim_get_motor(simmotor, &m)) return;
+	DBG("Simulated motor stops at %ld (lost %lu half-steps)", m.pos, m.lost);
+}
+
+/**
+ * Map state of model (supervisor calls it before starting of child,
+ * so restarted child gets the same speed & lamps)
+ */
+void steppers_open_state(){
+	if(state) return;
+	if(!(state = state_open(STATE_FILE, 1))){
+		fprintf(stderr, "Can't map " STATE_FILE ", state won't be kept over restarts\n");
+		state = &nostate;
+	}
+}
 
 void setup_pins(){
-#ifdef __arm__
-	wiringPiSetupGpio();
-	pinMode(MOTOR_PIN1, OUTPUT);
-	pinMode(MOTOR_PIN2, OUTPUT);
-	pinMode(MOTOR_PIN3, OUTPUT);
-	pinMode(MOTOR_PIN4, OUTPUT);
-	pinMode(LAMP1_PIN, OUTPUT);
-	pinMode(LAMP2_PIN, OUTPUT);
-	pinMode(ESW1_PIN, INPUT);
-	pinMode(ESW2_PIN, INPUT);
+	gpio_setup();
+	DBG("GPIO backend: %s", gpio_backend());
+	motion_setup(&motor, 1);
+	gpio_mode(LAMP1_PIN, GPIO_OUT);
+	gpio_mode(LAMP2_PIN, GPIO_OUT);
+	if(gpio_simulate) setup_simulation();
+	// end-switches stop motor by edge events
+	if(axis_limit(&motor, -1, ESW1_PIN, ESW_DEBOUNCE) || axis_limit(&motor, 1, ESW2_PIN, ESW_DEBOUNCE))
+		fprintf(stderr, "Can't watch end-switches\n");
 
 	stop_motor();
-	Write(LAMP1_PIN, 1);
-	Write(LAMP2_PIN, 1);
-#else // __arm__
-	printf("Setup GPIO\n");
-#endif // __arm__
+	// lamps & speed after restart are the same as before
+	steppers_open_state();
+	set_lamp(1, state->lamps & 1);
+	set_lamp(2, state->lamps & 2);
+	if(state->speed) set_motors_speed(state->speed);
 }
 
-#ifdef __arm__
-volatile int glob_dir = 0, stepspersec = 150;
-volatile unsigned int steps = 0, stopat = 0;
-volatile double halfsteptime;
-#endif // __arm__
-
 /**
  * Stop stepper motor
  */
 void stop_motor(){
-#ifdef __arm__
 	// disable motor & all other
-	Write(MOTOR_PIN1, 0);
-	Write(MOTOR_PIN2, 0);
-	Write(MOTOR_PIN3, 0);
-	Write(MOTOR_PIN4, 0);
-	DBG("STOPPED");
-#else
-	printf("Stop Stepper\n");
-#endif // __arm__
+	axis_stop(&motor);
 }
 
-int steppart = 0;
 /**
  * Rotate motors X,Y to direction dir (CW > 0)
  * Stop motor if dir == 0
  */
 void move_motor(int dir){
 	if(dir == 0){ // stop
-#ifdef __arm__
-		glob_dir = 0;
-		stopat = 0;
 		stop_motor();
+		DBG("STOPPED");
 	//	exit(0);
-#else // __arm__
-		printf("Stop motor\n");
-#endif // __arm__
-	}else{
-#ifdef __arm__
-	if((digitalRead(ESW1_PIN) == 0  && dir == -1) || 
-		(digitalRead(ESW2_PIN) == 0 && dir == 1)){
+	}else Xmove(dir, 0);
+}
+
+/**
+ * Move motors in direction dir to Nsteps
+ * (if Nsteps == 0 then move infinitely)
+ */
+void Xmove(int dir, unsigned int Nsteps){
+	if(dir == 0){
+		move_motor(0);
+		return;
+	}
+	int esw = get_endsw();
+	if(((esw & 1) && dir == -1) || ((esw & 2) && dir == 1)){
 		DBG("already on ESW");
 	//	exit(0);
-		glob_dir = 0;
-	}else{
-		glob_dir = dir;
-		if(dir > 0) steppart = 0;
-		else steppart = 7;
-		DBG("move to %d", dir);
+		stop_motor();
+		return;
 	}
-#else // __arm__
-		printf("Move X to %s\n", (dir > 0) ? "++" : "--");
-#endif // __arm__
+	axis_move(&motor, dir, Nsteps * PPS(), stepspersec);
+	DBG("move to %d", dir);
+}
+
+/**
+ * Put telemetry after each full step (called from steppers' thread)
+ * @return !0 to stop motor
+ */
+static int on_pulse(axis_t *a, const struct timespec *now){
+	uint16_t event = 0;
+	if(a->steps % PPS()) return 0; // full step isn't processed yet
+	if(a->stopat && a->stopat <= a->steps) // finite move for stopat steps
+		event = TELEM_EV_POSITION;
+	// don't format anything here: put binary record for websockets' thread
+	uint64_t t = (uint64_t)now->tv_sec * 1000000ULL + now->tv_nsec / 1000;
+	if(telemetry_due(t) || event){
+		telemetry_rec r = {t, a->steps / PPS(), a->dir, a->limits, event, 0, 0};
+		telemetry_push(&r);
 	}
+	return event; // stop motor at destination
 }
 
 /**
- * Move motors in direction dir to Nsteps
- * (if Nsteps == 0 then move infinitely)
+ * Motor stopped: it could be stopped by end-switch (called from steppers' thread)
  */
-void Xmove(int dir, unsigned int Nsteps){
-#ifdef __arm__
-	steps = 0;
-	stopat = Nsteps;
-	move_motor(dir);
-#else
-	printf("Move x axis to %u in dir %d\n", Nsteps, dir);
-#endif // __arm__
+static void on_stop(axis_t *a){
+	int esw = a->limits;
+	if(esw & LIMIT_BIT(a->dir)){
+		struct timespec now;
+		clock_now(&now);
+		telemetry_rec r = {(uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000,
+			a->steps / PPS(), a->dir, esw, TELEM_EV_ESW, 0, 0};
+		telemetry_push(&r);
+	}
+	sim_stopped();
+	steppers_wake();
+}
+
+/**
+ * Wait until motor stops
+ * @param cancel - waiting is interrupted when it becomes !0 (& steppers_wake() is called)
+ * @return 0 if motor stopped, 1 if waiting is cancelled
+ */
+int wait_motor_stop(const volatile int *cancel){
+	pthread_mutex_lock(&stop_mutex);
+	// running is cleared before on_stop() broadcasts, so wakeup can't be lost
+	while(motor.running && !*cancel) pthread_cond_wait(&stop_cond, &stop_mutex);
+	pthread_mutex_unlock(&stop_mutex);
+	return *cancel ? 1 : 0;
+}
+
+/**
+ * Wake up all threads waiting in wait_motor_stop()
+ */
+void steppers_wake(){
+	pthread_mutex_lock(&stop_mutex);
+	pthread_cond_broadcast(&stop_cond);
+	pthread_mutex_unlock(&stop_mutex);
 }
 
 void set_motors_speed(int steps_per_sec){
 	if(steps_per_sec > 0 && steps_per_sec < MAX_SPEED){
-#ifdef __arm__
 		stepspersec = steps_per_sec;
-		halfsteptime = 1. / (stepspersec * 8.);
+		if(state) state->speed = steps_per_sec;
+		motor.profile.v0 = motor.profile.vmax = steps_per_sec;
+		axis_set_speed(&motor, steps_per_sec);
 		GLOB_MESG("curspd=%d", get_motors_speed());
 
-#else // __arm__
-		printf("Set speed to %d\n", steps_per_sec);
-#endif // __arm__
 	}
 }
 
 int get_motors_speed(){
-#ifdef __arm__
 	return stepspersec;
-#else // __arm__
-	return 111;
-#endif // __arm__
+}
+
+/**
+ * Get requested & really achieved (in last second of moving) speed
+ * @param requested - steps per second by current half-step period
+ * @param achieved  - measured steps per second
+ * @return amount of missed deadlines
+ */
+unsigned int get_step_rate(double *requested, double *achieved){
+	return axis_rate(&motor, requested, achieved);
+}
+
+/**
+ * Change step mode of motor
+ * @param mode - 'h' - half-steps, 'f' - full steps (two coils), 'w' - wave (one coil)
+ * @return 0 if all OK, 1 if motor is moving, 2 if mode is wrong
+ */
+int set_step_mode(char mode){
+	const char *modes = "hfw", *m = strchr(modes, mode);
+	if(!mode || !m) return 2;
+	return axis_step_mode(&motor, m - modes);
+}
+
+/**
+ * @return current step mode: 'h', 'f' or 'w'
+ */
+char get_step_mode(){
+	return "hfw"[motor.stepmode];
+}
+
+/**
+ * Get statistics of pulses lateness
+ */
+void get_jitter(jitter_stat *s){
+	jitter_get(&motor.jitter, s);
+}
+
+void clear_jitter(){
+	jitter_clear(&motor.jitter);
+}
+
+/**
+ * @return CPU usage of steppers' thread (percents) since previous call
+ */
+double get_steppers_cpu(){
+	return motion_cpu_usage();
 }
 
 
@@ -232,155 +280,59 @@ extern volatile int force_exit;
  */
 void *steppers_thread(_U_ void *buf){
 	DBG("steppers_thr");
-#ifdef __arm__
-	double laststeptime, curtime;
-	halfsteptime = 1. / (stepspersec * 8.);
-	DBG("halfsteptime: %g", halfsteptime);
-	laststeptime = dtime();
-	int eswsteps = 0;
-	while(!force_exit){
-		usleep(10); // garanteed pause == 10us
-		if(glob_dir){
-			//DBG("cur-last=%g, half: %g", dtime() - laststeptime, halfsteptime);
-			if((curtime = dtime()) - laststeptime > halfsteptime){
-				//DBG("1/8step");
-				
-				Write(MOTOR_PIN1, steps_half[steppart][0]);
-				Write(MOTOR_PIN2, steps_half[steppart][1]);
-				Write(MOTOR_PIN3, steps_half[steppart][2]);
-				Write(MOTOR_PIN4, steps_half[steppart][3]);
-				/*
-				Write(MOTOR_PIN1, steps_full[steppart][0]);
-				Write(MOTOR_PIN2, steps_full[steppart][1]);
-				Write(MOTOR_PIN3, steps_full[steppart][2]);
-				Write(MOTOR_PIN4, steps_full[steppart][3]);
-				*/
-				//DBG("steppart: %d", steppart);
-				laststeptime = curtime;
-				int fullstep = 0;
-				if(glob_dir > 0){
-					if(++steppart == 8){
-					//if(++steppart == 4){
-						steppart = 0;
-						fullstep = 1;
-					}
-				}else{
-					if(--steppart < 0){
-						steppart = 7;
-						//steppart = 3;
-						fullstep = 1;
-					}
-				}
-				if(fullstep){ // full step processed
-					++steps;
-					if(steps % 10 == 0) 
-						GLOB_MESG("nsteps=%d", steps);
-					// check end-switches, if motor reach esw, stop it
-					if((digitalRead(ESW1_PIN) == 0  && glob_dir == -1) || 
-							(digitalRead(ESW2_PIN) == 0 && glob_dir == 1)){
-						if(++eswsteps == 5){
-							int Nsw = get_endsw();
-							if(Nsw){
-								DBG("Reach end-switch %d @%u steps", Nsw, steps);
-								GLOB_MESG("esw=%d", Nsw);
-								move_motor(0);
-								GLOB_MESG("end-switch %d reached at %u steps", Nsw, steps);
-							}else eswsteps = 0;
-						}
-					}else eswsteps = 0;
-					//DBG("step");
-					if(stopat && stopat == steps){ // finite move for stopat steps
-						DBG("Reach position of %d steps", steps);
-						GLOB_MESG("position %d steps reached", steps);
-						move_motor(0);
-					}
-				}
-			}
-		}else{
-			steppart = 0;
-		}
-	}
-#else // __arm__
-	printf("Main steppers' thread\n");
-	while(1) usleep(1000);
-#endif // __arm__
+	motion_loop(&force_exit);
 	DBG("return motors_thr");
 	return NULL;
 }
 
+/**
+ * Stop steppers' thread (join it after this call)
+ */
+void steppers_stop(){
+	motion_stop();
+}
+
 int get_rest_steps(){
-#ifdef __arm__
-	if(glob_dir){
-		if(stopat){
-			return stopat - steps;
+	if(motor.running){
+		if(motor.stopat){
+			return (motor.stopat - motor.steps + PPS() - 1) / PPS();
 		}else
 			return 1; // always return on infinite move
 	}else return 0;
-#else
-	printf("get_rest_steps\n");
-	return 0;
-#endif // __arm__
 }
 
 int get_direction(){
-#ifdef __arm__
-	return glob_dir;
-#else // __arm__
-	printf("get_direction\n");
-	return 0;
-#endif // __arm__
+	return motor.running ? motor.dir : 0;
 }
-
-// 0 - none, 1 - ESW1, 2 - ESW2, 3 - both
+// 0 - none, 1 - ESW1, 2 - ESW2, 3 - both (debounced state from edge events)
 int get_endsw(){
-#ifdef __arm__
-	return (1 - digitalRead(ESW1_PIN)) + 2 * (1 - digitalRead(ESW2_PIN));
-#else // __arm__
-	printf("get_endsw\n");
-	return 0;
-#endif // __arm__
+	return motor.limits;
 }
 
 /**
- * turn on/off (state == 1/0 1 - on, 0 - off) lamp with number nlamp
+ * turn on/off (on == 1/0 1 - on, 0 - off) lamp with number nlamp
  * nlamp = {1, 2}
  */
-void set_lamp(int nlamp, int state){
-#ifdef __arm__
+void set_lamp(int nlamp, int on){
 	if(nlamp > 2 || nlamp < 1) return;
 	if(nlamp == 1)
-		Write(LAMP1_PIN, !state);
+		gpio_write(LAMP1_PIN, !on);
 	else
-		Write(LAMP2_PIN, !state);
-#else // __arm__
-	printf("set_lamp(%d, %d)\n", nlamp, state);
-#endif // __arm__
+		gpio_write(LAMP2_PIN, !on);
+	if(!state) return;
+	if(on) __atomic_or_fetch(&state->lamps, nlamp, __ATOMIC_RELAXED);
+	else __atomic_and_fetch(&state->lamps, ~nlamp, __ATOMIC_RELAXED);
 }
 
 void switch_lamp(int nlamp){
-#ifdef __arm__
 	if(nlamp > 2 || nlamp < 1) return;
-	if(nlamp == 1){
-		Write(LAMP1_PIN, !digitalRead(LAMP1_PIN));
-	}else{
-		Write(LAMP2_PIN, !digitalRead(LAMP2_PIN));
-	}
-#else // __arm__
-	printf("switch_lamp(%d)\n", nlamp);
-#endif // __arm__
+	set_lamp(nlamp, !(getlamp() & nlamp));
 }
 
 int getlamp(){
-#ifdef __arm__
-	return (1 - digitalRead(LAMP1_PIN)) + 2*(1 - digitalRead(LAMP2_PIN));
-#else // __arm__
-	printf("getlamp()\n");
-	return 0;
-#endif // __arm__
+	uint32_t lev = gpio_read_all();
+	return ((lev & PINMASK(LAMP1_PIN)) ? 0 : 1) + ((lev & PINMASK(LAMP2_PIN)) ? 0 : 2);
 }
 
 /*
-#ifdef __arm__
-#else // __arm__
-#endif // __arm__
 */
@@ -23,6 +23,8 @@
 #ifndef __STEPPER_H__
 #define __STEPPER_H__
 
+#include "rtsched.h"
+
 /*
  * Pins definition (used BROADCOM GPIO pins numbering)
  */
@@ -43,20 +45,30 @@
 // maximum 200 steps per second
 #define MAX_SPEED	(201)
 
+void steppers_open_state();
 void setup_pins();
 void stop_motor();
 void *steppers_thread(void *buf);
+void steppers_stop();
 void Xmove(int dir, unsigned int Nsteps);
 void move_motor(int dir);
 void set_motors_speed(int steps_per_sec);
 int get_motors_speed();
+unsigned int get_step_rate(double *requested, double *achieved);
+int set_step_mode(char mode);
+char get_step_mode();
+void get_jitter(jitter_stat *s);
+void clear_jitter();
+double get_steppers_cpu();
 
 int get_rest_steps();
 int get_direction();
+int wait_motor_stop(const volatile int *cancel);
+void steppers_wake();
 int get_endsw();
 int getlamp();
 
-void set_lamp(int nlamp, int state);
+void set_lamp(int nlamp, int on);
 void switch_lamp(int nlamp);
 
 #endif // __STEPPER_H__
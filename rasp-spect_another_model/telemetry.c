@@ -0,0 +1,209 @@
+/*
+ * telemetry.c - lock-free ring of binary records from steppers' thread
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "telemetry.h"
+
+/*
+ * Single producer (steppers' thread) & single consumer (websockets' thread):
+ * producer writes only `head`, consumer writes only `tail`, so no locks needed.
+ * Indexes are free-running, position in ring is (idx & (TELEMETRY_RING_SIZE-1))
+ * Sequences' thread writes into another ring, consumer merges them by time
+ * Consumer doesn't poll: when it has drained rings, producer wakes it by notify()
+ */
+typedef struct{
+	telemetry_rec rec[TELEMETRY_RING_SIZE];
+	unsigned int head, tail;
+} telemetry_ring;
+static telemetry_ring rings[2]; // 0 - steppers' thread, 1 - sequences' thread
+static unsigned int dropped = 0;  // records lost when ring is full
+static unsigned int period = 1000000 / TELEMETRY_DEFAULT_RATE; // us, 0 - events only
+static int rate = TELEMETRY_DEFAULT_RATE;
+static uint64_t lastpub = 0; // time of last periodic record (producer only)
+static void (*notify)() = NULL;
+static int waiting = 1; // consumer has drained rings & waits for notify()
+
+/**
+ * Monotonic time for timestamps
+ * @return time in microseconds
+ */
+uint64_t telemetry_time(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static int push(telemetry_ring *q, const telemetry_rec *r){
+	unsigned int h = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned int t = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if(h - t >= TELEMETRY_RING_SIZE){
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	q->rec[h & (TELEMETRY_RING_SIZE - 1)] = *r;
+	// seq_cst pairs with telemetry_pending(): record or wakeup can't be lost
+	__atomic_store_n(&q->head, h + 1, __ATOMIC_SEQ_CST);
+	if(notify && __atomic_exchange_n(&waiting, 0, __ATOMIC_SEQ_CST)) notify();
+	return 1;
+}
+
+/**
+ * Put record into ring (called only from steppers' thread)
+ * @return 1 if OK, 0 if ring is full (record dropped)
+ */
+int telemetry_push(const telemetry_rec *r){
+	return push(&rings[0], r);
+}
+
+/**
+ * Put record into ring of sequences (called only from sequences' thread)
+ * @return 1 if OK, 0 if ring is full (record dropped)
+ */
+int telemetry_push_seq(const telemetry_rec *r){
+	return push(&rings[1], r);
+}
+
+/**
+ * Check whether it's time for next periodic record (steppers' thread only)
+ * @param now - current time from telemetry_time()
+ * @return 1 if record should be published
+ */
+int telemetry_due(uint64_t now){
+	unsigned int p = __atomic_load_n(&period, __ATOMIC_RELAXED);
+	if(!p || now - lastpub < p) return 0;
+	lastpub = now;
+	return 1;
+}
+
+/**
+ * Set function called by producers when record appears after consumer drained rings
+ * (it's called from steppers' or sequences' thread, so it should only wake consumer)
+ */
+void telemetry_notify(void (*fn)()){
+	notify = fn;
+}
+
+/**
+ * Get oldest record from ring (called only from websockets' thread)
+ * @return 1 if record copied into r, 0 if ring is empty
+ */
+int telemetry_pop(telemetry_rec *r){
+	telemetry_rec *oldest = NULL;
+	int i, n = 0;
+	for(i = 0; i < 2; ++i){ // take older record of two rings
+		telemetry_ring *q = &rings[i];
+		unsigned int t = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		if(t == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) continue;
+		telemetry_rec *c = &q->rec[t & (TELEMETRY_RING_SIZE - 1)];
+		if(!oldest || c->time < oldest->time){
+			oldest = c;
+			n = i;
+		}
+	}
+	if(!oldest) return 0;
+	*r = *oldest;
+	__atomic_store_n(&rings[n].tail, rings[n].tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * Check rings after draining them (called only from websockets' thread)
+ * @return 1 if there are records yet, 0 if rings are empty: then next record calls notify()
+ */
+int telemetry_pending(){
+	int i;
+	__atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+	for(i = 0; i < 2; ++i)
+		if(__atomic_load_n(&rings[i].tail, __ATOMIC_RELAXED) !=
+			__atomic_load_n(&rings[i].head, __ATOMIC_SEQ_CST)){
+			// consumer will take it by itself
+			__atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+			return 1;
+		}
+	return 0;
+}
+
+/**
+ * Throw out all stale records (e.g. when new client connected)
+ */
+void telemetry_flush(){
+	int i;
+	for(i = 0; i < 2; ++i)
+		__atomic_store_n(&rings[i].tail, __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+}
+
+/**
+ * Make text messages for client from record
+ * @param r    - record
+ * @param part - number of message (0, 1, ...)
+ * @param buf  - output buffer
+ * @param len  - its length
+ * @return 0 if there's no message with number `part`
+ */
+int telemetry_format(const telemetry_rec *r, int part, char *buf, size_t len){
+	if(r->event & TELEM_EV_SEQSTEP){
+		if(part) return 0;
+		snprintf(buf, len, "seq=%u/%u,%c", r->position + 1, r->nsteps, r->op);
+		return 1;
+	}
+	if(r->event & TELEM_EV_SEQEND){
+		if(part) return 0;
+		snprintf(buf, len, "seq=%s,%u/%u", r->dir ? "aborted" : "done", r->position, r->nsteps);
+		return 1;
+	}
+	if(part == 0){
+		snprintf(buf, len, "nsteps=%u", r->position);
+		return 1;
+	}
+	if(r->event & TELEM_EV_ESW){
+		if(part == 1){
+			snprintf(buf, len, "esw=%d", r->esw);
+			return 1;
+		}else if(part == 2){
+			snprintf(buf, len, "end-switch %d reached at %u steps", r->esw, r->position);
+			return 1;
+		}
+	}else if((r->event & TELEM_EV_POSITION) && part == 1){
+		snprintf(buf, len, "position %u steps reached", r->position);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Set rate of periodic records
+ * @param newrate - records per second, 0 - send only events
+ */
+void telemetry_set_rate(int newrate){
+	if(newrate < 0 || newrate > TELEMETRY_MAX_RATE) return;
+	rate = newrate;
+	__atomic_store_n(&period, newrate ? 1000000 / newrate : 0, __ATOMIC_RELAXED);
+}
+
+int telemetry_get_rate(){
+	return rate;
+}
+
+unsigned int telemetry_dropped(){
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
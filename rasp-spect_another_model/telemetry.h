@@ -0,0 +1,70 @@
+/*
+ * telemetry.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// amount of records in ring, must be a power of 2
+#define TELEMETRY_RING_SIZE     (256)
+// default & max rate of periodic records (records per second)
+#define TELEMETRY_DEFAULT_RATE  (20)
+#define TELEMETRY_MAX_RATE      (1000)
+
+// event flags
+#define TELEM_EV_ESW       (1<<0)  // motor stopped on end-switch
+#define TELEM_EV_POSITION  (1<<1)  // finite move reached its target
+#define TELEM_EV_SEQSTEP   (1<<2)  // step of sequence started
+#define TELEM_EV_SEQEND    (1<<3)  // sequence finished
+
+// one record from steppers' or sequences' thread, fixed size
+typedef struct{
+	uint64_t time;      // CLOCK_MONOTONIC timestamp, microseconds
+	uint32_t position;  // full steps from start of current move (sequence: number of step)
+	int8_t   dir;       // direction of moving (-1, 0, 1); sequence end: 0 - done, 1 - aborted
+	uint8_t  esw;       // end-switches state (same as get_endsw())
+	uint16_t event;     // event flags TELEM_EV_*
+	char     op;        // sequence: operation of step
+	uint8_t  nsteps;    // sequence: total amount of steps
+} telemetry_rec;
+
+uint64_t telemetry_time();
+
+// producer side (steppers' thread only)
+int telemetry_push(const telemetry_rec *r);
+int telemetry_due(uint64_t now);
+// sequences' thread has its own ring
+int telemetry_push_seq(const telemetry_rec *r);
+
+// consumer side (websockets' thread only)
+void telemetry_notify(void (*fn)());
+int telemetry_pop(telemetry_rec *r);
+int telemetry_pending();
+void telemetry_flush();
+int telemetry_format(const telemetry_rec *r, int part, char *buf, size_t len);
+
+void telemetry_set_rate(int rate);
+int telemetry_get_rate();
+unsigned int telemetry_dropped();
+
+#endif // __TELEMETRY_H__
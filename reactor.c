@@ -0,0 +1,187 @@
+/*
+ * reactor.c - single epoll loop of main thread: sockets of websockets, timers &
+ *             wakeups by other threads (eventfd), there's no polling sleeps
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+#ifndef _U_
+	#define _U_  __attribute__((__unused__))
+#endif
+
+#define MAXEVENTS  (32)
+
+static struct{
+	reactor_handler handler;
+	void *arg;
+	int timer;  // fd is timerfd: read amount of expirations before handler
+} watched[REACTOR_MAXFD];
+
+static int epfd = -1, wakefd = -1;
+static void (*wake_handler)() = NULL;
+
+static uint32_t to_epoll(int events){
+	return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+static int from_epoll(uint32_t events){
+	return ((events & EPOLLIN) ? POLLIN : 0) | ((events & EPOLLOUT) ? POLLOUT : 0) |
+		((events & EPOLLERR) ? POLLERR : 0) | ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+static void on_wakefd(int fd, _U_ int revents, _U_ void *arg){
+	uint64_t n;
+	if(read(fd, &n, sizeof(n)) != sizeof(n)) return;
+	if(wake_handler) wake_handler();
+}
+
+/**
+ * Create epoll & eventfd for wakeups
+ * @param on_wake - called by reactor after reactor_wake() (several wakeups can give one call)
+ * @return 0 if all OK
+ */
+int reactor_init(void (*on_wake)()){
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+		perror("epoll_create1()");
+		return 1;
+	}
+	if((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+		perror("eventfd()");
+		return 1;
+	}
+	wake_handler = on_wake;
+	return reactor_add(wakefd, POLLIN, on_wakefd, NULL);
+}
+
+/**
+ * Watch events of fd
+ * @param events - POLLIN and/or POLLOUT
+ * @return 0 if all OK
+ */
+int reactor_add(int fd, int events, reactor_handler h, void *arg){
+	struct epoll_event ev;
+	if(fd < 0 || fd >= REACTOR_MAXFD){
+		fprintf(stderr, "reactor: can't watch fd %d\n", fd);
+		return 1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll(events);
+	ev.data.fd = fd;
+	watched[fd].handler = h;
+	watched[fd].arg = arg;
+	watched[fd].timer = 0;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)){
+		perror("epoll_ctl()");
+		watched[fd].handler = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Change watched events of fd
+ * @return 0 if all OK
+ */
+int reactor_mod(int fd, int events){
+	struct epoll_event ev;
+	if(fd < 0 || fd >= REACTOR_MAXFD || !watched[fd].handler) return 1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll(events);
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) ? 1 : 0;
+}
+
+void reactor_del(int fd){
+	if(fd < 0 || fd >= REACTOR_MAXFD || !watched[fd].handler) return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	watched[fd].handler = NULL;
+}
+
+/**
+ * Periodic timer
+ * @param period_ms - period, ms
+ * @param h         - handler, called with fd of timer after each expiration
+ * @return 0 if all OK
+ */
+int reactor_timer(long period_ms, reactor_handler h, void *arg){
+	struct itimerspec its;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0){
+		perror("timerfd_create()");
+		return 1;
+	}
+	its.it_interval.tv_sec = period_ms / 1000;
+	its.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(fd, 0, &its, NULL)){
+		perror("timerfd_settime()");
+		close(fd);
+		return 1;
+	}
+	if(reactor_add(fd, POLLIN, h, arg)){
+		close(fd);
+		return 1;
+	}
+	watched[fd].timer = 1;
+	return 0;
+}
+
+/**
+ * Wake up reactor: it calls on_wake (from any thread or signal handler)
+ */
+void reactor_wake(){
+	uint64_t one = 1;
+	if(wakefd < 0) return;
+	if(write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) return;
+}
+
+/**
+ * Process events until quit flag is set (it's checked after each wakeup)
+ */
+void reactor_run(const volatile int *quit){
+	struct epoll_event evs[MAXEVENTS];
+	int i, n;
+	while(!*quit){
+		n = epoll_wait(epfd, evs, MAXEVENTS, -1);
+		if(n < 0){
+			if(errno == EINTR) continue;
+			perror("epoll_wait()");
+			break;
+		}
+		for(i = 0; i < n; ++i){
+			int fd = evs[i].data.fd;
+			// handler of previous event could remove this fd
+			if(fd < 0 || fd >= REACTOR_MAXFD || !watched[fd].handler) continue;
+			if(watched[fd].timer){
+				uint64_t expirations;
+				if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) continue;
+			}
+			watched[fd].handler(fd, from_epoll(evs[i].events), watched[fd].arg);
+		}
+	}
+}
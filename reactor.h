@@ -0,0 +1,41 @@
+/*
+ * reactor.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stdint.h>
+
+// max value of watched file descriptor
+#define REACTOR_MAXFD  (1024)
+
+// handler of events (POLLIN, POLLOUT, POLLERR, POLLHUP) on fd
+typedef void (*reactor_handler)(int fd, int revents, void *arg);
+
+int reactor_init(void (*on_wake)());
+int reactor_add(int fd, int events, reactor_handler h, void *arg);
+int reactor_mod(int fd, int events);
+void reactor_del(int fd);
+int reactor_timer(long period_ms, reactor_handler h, void *arg);
+void reactor_wake();
+void reactor_run(const volatile int *quit);
+
+#endif // __REACTOR_H__
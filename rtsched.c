@@ -0,0 +1,225 @@
+/*
+ * rtsched.c - absolute-time sleeping & real-time setup for steppers' thread
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rtsched.h"
+
+#define NSEC_PER_SEC  (1000000000L)
+// interval of achieved rate measurement, ns
+#define RATE_INTERVAL (NSEC_PER_SEC)
+
+rt_params rtparams = {0, -1, 0, 0};
+
+// virtual clock (ns), runs only when steppers' thread waits for deadlines
+static int64_t vclock = 0;
+
+/**
+ * Apply rtparams to calling thread
+ * @return 0 if all OK, 1 if some of parameters can't be set
+ */
+int rt_setup_thread(){
+	int ret = 0, err;
+	if(rtparams.memlock && mlockall(MCL_CURRENT | MCL_FUTURE)){
+		perror("mlockall()");
+		ret = 1;
+	}
+	if(rtparams.cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rtparams.cpu, &set);
+		if((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))){
+			fprintf(stderr, "Can't pin thread to CPU%d: %s\n", rtparams.cpu, strerror(err));
+			ret = 1;
+		}
+	}
+	if(rtparams.priority > 0){
+		struct sched_param sp;
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = rtparams.priority;
+		if((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))){
+			fprintf(stderr, "Can't set SCHED_FIFO priority %d: %s\n", rtparams.priority, strerror(err));
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Add ns nanoseconds to ts
+ */
+void ts_add(struct timespec *ts, long ns){
+	ts->tv_sec += ns / NSEC_PER_SEC;
+	ts->tv_nsec += ns % NSEC_PER_SEC;
+	if(ts->tv_nsec >= NSEC_PER_SEC){
+		ts->tv_nsec -= NSEC_PER_SEC;
+		++ts->tv_sec;
+	}
+}
+
+/**
+ * @return a - b in nanoseconds
+ */
+int64_t ts_diff(const struct timespec *a, const struct timespec *b){
+	return (int64_t)(a->tv_sec - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+/**
+ * Current time: CLOCK_MONOTONIC or virtual clock
+ */
+void clock_now(struct timespec *ts){
+	int64_t t;
+	if(!rtparams.virtime){
+		clock_gettime(CLOCK_MONOTONIC, ts);
+		return;
+	}
+	t = __atomic_load_n(&vclock, __ATOMIC_ACQUIRE);
+	if(!t){ // first call: start from real time
+		clock_gettime(CLOCK_MONOTONIC, ts);
+		t = (int64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+		int64_t z = 0;
+		if(!__atomic_compare_exchange_n(&vclock, &z, t, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			t = z;
+	}
+	ts->tv_sec = t / NSEC_PER_SEC;
+	ts->tv_nsec = t % NSEC_PER_SEC;
+}
+
+/**
+ * Sleep until clock reaches ts
+ * (with virtual time just move clock forward)
+ */
+void wait_deadline(const struct timespec *ts){
+	if(rtparams.virtime){
+		int64_t t = (int64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+		int64_t cur = __atomic_load_n(&vclock, __ATOMIC_ACQUIRE);
+		while(cur < t && !__atomic_compare_exchange_n(&vclock, &cur, t, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		return;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL) == EINTR);
+}
+
+/**
+ * Start new measurement (when motion starts)
+ */
+void rate_reset(rate_meter *m, const struct timespec *now){
+	m->start = *now;
+	m->nsteps = 0;
+}
+
+/**
+ * Count one step made at time now & refresh achieved rate each RATE_INTERVAL
+ */
+void rate_count(rate_meter *m, const struct timespec *now){
+	int64_t dt = ts_diff(now, &m->start);
+	++m->nsteps;
+	if(dt >= RATE_INTERVAL){
+		m->achieved = (double)m->nsteps * NSEC_PER_SEC / dt;
+		rate_reset(m, now);
+	}
+}
+
+/**
+ * Number of histogram bin for lateness t (ns)
+ */
+static int jitter_bin(int64_t t){
+	int msb, bin;
+	if(t < 1024) return (int)(t >> 7);
+	msb = 63 - __builtin_clzll((uint64_t)t);
+	bin = (msb - 9) * JITTER_SUBBINS + (int)((t >> (msb - 3)) & (JITTER_SUBBINS - 1));
+	return (bin < JITTER_NBINS) ? bin : JITTER_NBINS - 1;
+}
+
+/**
+ * Upper bound (ns) of histogram bin
+ */
+static int64_t jitter_bound(int bin){
+	int oct = bin / JITTER_SUBBINS, sub = bin % JITTER_SUBBINS;
+	if(!oct) return (int64_t)(sub + 1) << 7;
+	return (int64_t)(JITTER_SUBBINS + sub + 1) << (oct + 6);
+}
+
+/**
+ * Add lateness of step to histogram (steppers' thread only)
+ * @param late   - time from deadline to real edge, ns
+ * @param missed - !0 if deadline is missed
+ */
+void jitter_add(jitter_hist *h, int64_t late, int missed){
+	if(h->clear){
+		memset(h->bins, 0, sizeof(h->bins));
+		__atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->missed, 0, __ATOMIC_RELAXED);
+		h->clear = 0;
+	}
+	if(late < 0) late = 0;
+	int bin = jitter_bin(late);
+	__atomic_store_n(&h->bins[bin], h->bins[bin] + 1, __ATOMIC_RELAXED);
+	if(!h->count || late < h->min) __atomic_store_n(&h->min, late, __ATOMIC_RELAXED);
+	if(!h->count || late > h->max) __atomic_store_n(&h->max, late, __ATOMIC_RELAXED);
+	if(missed){
+		__atomic_store_n(&h->missed, h->missed + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->total_missed, h->total_missed + 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&h->total_late, h->total_late + (uint64_t)late, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Clear histogram (from any thread: it will be cleared by writer)
+ */
+void jitter_clear(jitter_hist *h){
+	h->clear = 1;
+}
+
+/**
+ * Get statistics of histogram (from any thread)
+ */
+void jitter_get(const jitter_hist *h, jitter_stat *s){
+	uint32_t bins[JITTER_NBINS], n = 0, cum = 0;
+	double *p[4] = {&s->p50, &s->p90, &s->p99, &s->p999};
+	const double q[4] = {0.5, 0.9, 0.99, 0.999};
+	int i, j = 0;
+	memset(s, 0, sizeof(jitter_stat));
+	s->total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+	s->total_missed = __atomic_load_n(&h->total_missed, __ATOMIC_RELAXED);
+	s->total_late = __atomic_load_n(&h->total_late, __ATOMIC_RELAXED) / 1e3;
+	if(h->clear || !(s->count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE))) return;
+	s->missed = __atomic_load_n(&h->missed, __ATOMIC_RELAXED);
+	s->min = __atomic_load_n(&h->min, __ATOMIC_RELAXED) / 1e3;
+	s->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3;
+	for(i = 0; i < JITTER_NBINS; ++i)
+		n += (bins[i] = __atomic_load_n(&h->bins[i], __ATOMIC_RELAXED));
+	for(i = 0; i < JITTER_NBINS && j < 4; ++i){
+		cum += bins[i];
+		while(j < 4 && cum >= q[j] * n){ // bin bound can't be more than max
+			double b = jitter_bound(i) / 1e3;
+			*p[j++] = (b < s->max) ? b : s->max;
+		}
+	}
+}
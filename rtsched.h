@@ -0,0 +1,85 @@
+/*
+ * rtsched.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __RTSCHED_H__
+#define __RTSCHED_H__
+
+#include <time.h>
+#include <stdint.h>
+
+// real-time parameters of steppers' thread (set from command line)
+typedef struct{
+	int priority;   // SCHED_FIFO priority, 0 - leave default scheduler
+	int cpu;        // CPU to pin thread to, -1 - any
+	int memlock;    // !0 - lock all memory with mlockall()
+	int virtime;    // !0 - virtual time: deadlines are reached at once (simulation only)
+} rt_params;
+
+extern rt_params rtparams;
+
+// achieved step rate measurement
+typedef struct{
+	struct timespec start;  // start of current measurement interval
+	unsigned int nsteps;    // steps made in current interval
+	unsigned int missed;    // amount of missed deadlines
+	double achieved;        // steps per second in last full interval
+} rate_meter;
+
+// histogram of lateness of steps: 8 bins by 128ns below 1us, then 8 bins per octave
+#define JITTER_SUBBINS  (8)
+#define JITTER_NBINS    (22*JITTER_SUBBINS)
+
+// written only by steppers' thread, read without locks
+typedef struct{
+	uint32_t bins[JITTER_NBINS];
+	uint32_t count;         // amount of samples
+	uint32_t missed;        // deadlines missed for more than pulse period
+	int64_t min, max;       // ns
+	volatile int clear;     // set by reader: histogram is cleared before next sample
+	// totals since start: they aren't cleared (monotonic counters for monitoring)
+	uint64_t total, total_missed;
+	uint64_t total_late;    // ns
+} jitter_hist;
+
+// statistics of histogram, times in microseconds
+typedef struct{
+	uint32_t count, missed;
+	double min, max;
+	double p50, p90, p99, p999; // percentiles (upper bounds of bins)
+	uint64_t total, total_missed; // since start, jitter_clear() doesn't reset them
+	double total_late;
+} jitter_stat;
+
+int rt_setup_thread();
+
+void clock_now(struct timespec *ts);
+void ts_add(struct timespec *ts, long ns);
+int64_t ts_diff(const struct timespec *a, const struct timespec *b);
+void wait_deadline(const struct timespec *ts);
+
+void rate_reset(rate_meter *m, const struct timespec *now);
+void rate_count(rate_meter *m, const struct timespec *now);
+
+void jitter_add(jitter_hist *h, int64_t late, int missed);
+void jitter_clear(jitter_hist *h);
+void jitter_get(const jitter_hist *h, jitter_stat *s);
+
+#endif // __RTSCHED_H__
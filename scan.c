@@ -0,0 +1,440 @@
+/*
+ * scan.c - pipelined scan: axis moves to next position while previous
+ *          frame is encoded & sent to client;
+ *          lamp-on/lamp-off differential frames: frames are decoded &
+ *          subtracted while lamp settles
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "scan.h"
+#include "stepper.h"
+#include "rtsched.h"
+#include "trace.h"
+#include "state.h"
+
+#ifndef _U_
+	#define _U_  __attribute__((__unused__))
+#endif
+
+static struct{
+	int axis;
+	long start, step;
+	int count;
+	int lamp, settle;  // differential frames: lamp number & its settling time (ms)
+	int first;         // index of first frame (!0 if job is resumed after restart)
+	void (*notify)(); // called when new frame is ready to send
+} job;
+
+static volatile int active = 0, stopscan = 0, finished = 0;
+static char result[128];
+
+// encoded frames waiting for sending
+static imbuf frames[SCAN_QLEN];
+static int fhead = 0, fnum = 0;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+// job thread sleeps on it until deadline (CLOCK_MONOTONIC) or stop
+static pthread_cond_t sleep_cond;
+static int sleep_cond_ok = 0;
+
+/**
+ * Store job in shared state, so restarted child could resume it
+ */
+static void job_save(int type, int a0, int a1, int a2, int a3){
+	motion_state *st = state_get();
+	if(!st) return;
+	state_job j = {type, {a0, a1, a2, a3}, 0, 0};
+	st->job = j;
+}
+
+/**
+ * @return !0 if value can be stored in job's arguments
+ */
+static int fits_job(int64_t v){
+	return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+/**
+ * Frame idx is ready: restarted child will begin from next
+ */
+static void job_progress(int idx){
+	motion_state *st = state_get();
+	if(!st) return;
+	st->job.done = idx + 1;
+	st->job.tries = 0;
+}
+
+static void job_clear(){
+	motion_state *st = state_get();
+	if(st) st->job.type = STATE_JOB_NONE;
+}
+
+/**
+ * Put encoded frame into queue (wait while queue is full)
+ * @return 0 if all OK
+ */
+static int push_frame(imbuf *buf){
+	pthread_mutex_lock(&scan_mutex);
+	while(fnum == SCAN_QLEN && !stopscan)
+		pthread_cond_wait(&scan_cond, &scan_mutex);
+	if(stopscan){
+		pthread_mutex_unlock(&scan_mutex);
+		free_imbuf(buf);
+		return 1;
+	}
+	frames[(fhead + fnum) % SCAN_QLEN] = *buf;
+	++fnum;
+	pthread_mutex_unlock(&scan_mutex);
+	memset(buf, 0, sizeof(imbuf));
+	if(job.notify) job.notify();
+	return 0;
+}
+
+/**
+ * Get next frame to send
+ * @param buf - empty buffer, it will own frame data
+ * @return 1 if there was a frame
+ */
+int scan_pop(imbuf *buf){
+	pthread_mutex_lock(&scan_mutex);
+	if(!fnum){
+		pthread_mutex_unlock(&scan_mutex);
+		return 0;
+	}
+	*buf = frames[fhead];
+	fhead = (fhead + 1) % SCAN_QLEN;
+	--fnum;
+	pthread_cond_signal(&scan_cond);
+	pthread_mutex_unlock(&scan_mutex);
+	return 1;
+}
+
+/**
+ * @return amount of frames waiting for sending
+ */
+int scan_pending(){
+	return __atomic_load_n(&fnum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Encode captured frame with its position tag & put into queue
+ * @return 0 if all OK
+ */
+static int send_frame(imbuf *raw, int idx, long pos, uint64_t rx){
+	char tag[64];
+	snprintf(tag, 64, "scan=%d,%c:%ld\n", idx, job.axis ? 'Y' : 'X', pos);
+	encode_image(raw, tag);
+	if(!raw->data) return 1;
+	frame_meta(raw, (uint32_t)idx, rx);
+	trace(TR_SCAN_FRAME, idx, pos);
+	return push_frame(raw);
+}
+
+static void *scan_thread(_U_ void *arg){
+	imbuf raw = {NULL, 0};
+	int i, ret = 0, idx = 0, nframes = 0;
+	long pos = 0;
+	uint64_t rx = 0;
+	struct timespec t0, t1;
+	trace_thread("scan");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < job.count && !stopscan; ++i){
+		if((ret = move_to(job.axis, job.start + i * job.step))) break;
+		// motor moves to next position: encode & send previous frame meanwhile
+		if(raw.data && !send_frame(&raw, idx, pos, rx)){
+			++nframes;
+			job_progress(idx);
+		}
+		if(wait_axis_stop(job.axis, &stopscan)) break;
+		get_position(job.axis, &pos);
+		idx = job.first + i;
+		if(!(raw.data = capture_frame(&raw.len, &rx))){
+			ret = 3;
+			break;
+		}
+	}
+	if(raw.data && !send_frame(&raw, idx, pos, rx)){
+		++nframes;
+		job_progress(idx);
+	}
+	job_clear();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	switch(ret){
+		case 0:
+			snprintf(result, 128, "Scan %s: %d frames in %.1fs", stopscan ? "stopped" : "done",
+				nframes, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+		break;
+		case 1:
+			snprintf(result, 128, "Scan aborted: motors are busy");
+		break;
+		case 2:
+			snprintf(result, 128, "Scan aborted: position is unknown, go to the middle first");
+		break;
+		default:
+			snprintf(result, 128, "Scan aborted: can't capture frame");
+	}
+	finished = 1;
+	active = 0;
+	if(job.notify) job.notify();
+	return NULL;
+}
+
+/**
+ * Run thread of job
+ * @return 0 if all OK
+ */
+static int run(void *(*thr)(void*)){
+	pthread_t thread;
+	imbuf old;
+	pthread_condattr_t attr;
+	while(scan_pop(&old)) free_imbuf(&old); // nobody took them
+	if(!sleep_cond_ok){
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		sleep_cond_ok = !pthread_cond_init(&sleep_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		if(!sleep_cond_ok) return 1;
+	}
+	stopscan = 0;
+	finished = 0;
+	active = 1;
+	if(pthread_create(&thread, NULL, thr, NULL)){
+		active = 0;
+		job_clear();
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/**
+ * Start scan: move axis to count positions from start with step,
+ * capture frame on each position & put it into queue for sending
+ * @param notify - function called when next frame is ready
+ * @return 0 if all OK, 1 if scan is running, 2 if parameters are wrong
+ */
+int scan_start(int axis, long start, long step, int count, void (*notify)()){
+	if(active) return 1;
+	if((axis != 0 && axis != 1) || count < 1) return 2;
+	// job & positions are kept in 32-bit fields of state
+	if(!fits_job(start) || !fits_job(step) || !fits_job(start + (int64_t)(count - 1) * step)) return 2;
+	job.axis = axis;
+	job.start = start;
+	job.step = step;
+	job.count = count;
+	job.first = 0;
+	job.notify = notify;
+	job_save(STATE_JOB_SCAN, axis, (int32_t)start, (int32_t)step, count);
+	return run(scan_thread);
+}
+
+/**
+ * Sleep until absolute deadline (CLOCK_MONOTONIC) or stop of scan
+ */
+static void sleep_until(const struct timespec *deadline){
+	pthread_mutex_lock(&scan_mutex);
+	while(!stopscan && pthread_cond_timedwait(&sleep_cond, &scan_mutex, deadline) != ETIMEDOUT);
+	pthread_mutex_unlock(&scan_mutex);
+}
+
+/**
+ * Put difference image with its profile into queue
+ * @return 0 if all OK
+ */
+static int send_diff(const grayimg *dif, const int32_t *profile, int idx, uint64_t rx){
+	imbuf buf = {NULL, 0};
+	int x;
+	size_t L, S = 64 + (size_t)dif->width * 12;
+	char *tag = malloc(S);
+	if(!tag) return 1;
+	L = (size_t)snprintf(tag, S, "diff=%d,lamp=%d,profile=", idx, job.lamp);
+	for(x = 0; x < dif->width; ++x)
+		L += (size_t)snprintf(tag + L, S - L, "%s%d", x ? "," : "", profile[x]);
+	snprintf(tag + L, S - L, "\n");
+	if(gray_to_jpeg(dif, &buf)){
+		free(tag);
+		return 1;
+	}
+	encode_image(&buf, tag);
+	free(tag);
+	if(!buf.data) return 1;
+	frame_meta(&buf, (uint32_t)idx, rx);
+	return push_frame(&buf);
+}
+
+static void *diff_thread(_U_ void *arg){
+	imbuf raw = {NULL, 0};
+	grayimg on = {0, 0, NULL}, off = {0, 0, NULL}, dif = {0, 0, NULL};
+	int32_t *profile = NULL;
+	uint64_t rx = 0;
+	int i, ret = 0, npairs = 0;
+	long settle = job.settle * 1000000L;
+	struct timespec t0, t1, t;
+	trace_thread("scan");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t = t0;
+	set_lamp(job.lamp, 1);
+	ts_add(&t, settle);
+	for(i = 0; (!job.count || i < job.count) && !stopscan; ++i){
+		sleep_until(&t);
+		if(stopscan) break;
+		if(!(raw.data = capture_frame(&raw.len, NULL))){
+			ret = 3;
+			break;
+		}
+		// lamp settles off: decode "on" frame meanwhile
+		set_lamp(job.lamp, 0);
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		ts_add(&t, settle);
+		ret = decode_frame(&raw, &on);
+		free_imbuf(&raw);
+		if(ret){
+			ret = 4;
+			break;
+		}
+		sleep_until(&t);
+		if(stopscan) break;
+		if(!(raw.data = capture_frame(&raw.len, &rx))){
+			ret = 3;
+			break;
+		}
+		// lamp settles on for next pair: process this pair meanwhile
+		if(!job.count || i + 1 < job.count){
+			set_lamp(job.lamp, 1);
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			ts_add(&t, settle);
+		}
+		ret = decode_frame(&raw, &off);
+		free_imbuf(&raw);
+		if(!ret && !profile && !(profile = malloc(on.width * sizeof(int32_t)))) ret = 1;
+		if(ret || diff_frames(&on, &off, &dif, profile)){
+			ret = 4;
+			break;
+		}
+		if(!send_diff(&dif, profile, job.first + i, rx)){
+			++npairs;
+			job_progress(job.first + i);
+		}
+	}
+	set_lamp(job.lamp, 0);
+	job_clear();
+	free_imbuf(&raw);
+	free_grayimg(&on);
+	free_grayimg(&off);
+	free_grayimg(&dif);
+	free(profile);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double tm = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	switch(ret){
+		case 0:
+			snprintf(result, 128, "Differential frames %s: %d pairs in %.1fs (%.2f pairs/s)",
+				stopscan ? "stopped" : "done", npairs, tm, npairs / tm);
+		break;
+		case 3:
+			snprintf(result, 128, "Differential frames aborted: can't capture frame");
+		break;
+		default:
+			snprintf(result, 128, "Differential frames aborted: can't decode frame");
+	}
+	finished = 1;
+	active = 0;
+	if(job.notify) job.notify();
+	return NULL;
+}
+
+/**
+ * Start differential frames: lamp is turned on & off in turn, "on" & "off" frames
+ * are captured after settle ms & their difference is put into queue for sending
+ * @param lamp   - lamp number (1 or 2)
+ * @param count  - amount of pairs (0 - until stop)
+ * @param settle - settling time of lamp, ms
+ * @param notify - function called when next frame is ready
+ * @return 0 if all OK, 1 if scan is running, 2 if parameters are wrong, 3 if there's no such lamp
+ */
+int scan_diff(int lamp, int count, int settle, void (*notify)()){
+	if(active) return 1;
+	if((lamp != 1 && lamp != 2) || count < 0 || settle < 0) return 2;
+	if(!lamp_fitted(lamp)) return 3;
+	job.lamp = lamp;
+	job.count = count;
+	job.settle = settle;
+	job.first = 0;
+	job.notify = notify;
+	job_save(STATE_JOB_DIFF, lamp, count, settle, 0);
+	return run(diff_thread);
+}
+
+/**
+ * Resume job interrupted by death of previous child (from next frame)
+ * @return 0 if job is resumed, 1 if there's no job or it fails again & again
+ */
+int scan_resume(void (*notify)()){
+	motion_state *st = state_get();
+	state_job *j;
+	if(!st || active || (j = &st->job)->type == STATE_JOB_NONE) return 1;
+	if(++j->tries > STATE_JOB_TRIES){
+		fprintf(stderr, "Job is dropped after %d restarts\n", STATE_JOB_TRIES);
+		j->type = STATE_JOB_NONE;
+		return 1;
+	}
+	job.first = j->done;
+	job.notify = notify;
+	if(j->type == STATE_JOB_SCAN){
+		job.axis = j->args[0];
+		job.start = j->args[1] + (long)j->done * j->args[2];
+		job.step = j->args[2];
+		job.count = j->args[3] - j->done;
+		if(job.count < 1) return 1;
+		printf("Resume scan from frame %d\n", j->done);
+		return run(scan_thread);
+	}
+	job.lamp = j->args[0];
+	job.count = j->args[1] ? j->args[1] - j->done : 0;
+	job.settle = j->args[2];
+	if(j->args[1] && job.count < 1) return 1;
+	printf("Resume differential frames from pair %d\n", j->done);
+	return run(diff_thread);
+}
+
+void scan_stop(){
+	pthread_mutex_lock(&scan_mutex);
+	stopscan = 1;
+	pthread_cond_broadcast(&scan_cond);
+	if(sleep_cond_ok) pthread_cond_broadcast(&sleep_cond);
+	pthread_mutex_unlock(&scan_mutex);
+	steppers_wake(); // scan thread can wait for motor
+}
+
+/**
+ * Get result of finished scan (once)
+ * @return 1 if scan is finished & msg is filled
+ */
+int scan_result(char *msg, size_t len){
+	if(!finished) return 0;
+	finished = 0;
+	snprintf(msg, len, "%s", result);
+	return 1;
+}
@@ -0,0 +1,39 @@
+/*
+ * scan.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stddef.h>
+#include "image.h"
+
+// max amount of frames waiting for sending
+#define SCAN_QLEN  (4)
+
+int scan_start(int axis, long start, long step, int count, void (*notify)());
+int scan_diff(int lamp, int count, int settle, void (*notify)());
+int scan_resume(void (*notify)());
+void scan_stop();
+int scan_pending();
+int scan_pop(imbuf *buf);
+int scan_result(char *msg, size_t len);
+
+#endif // __SCAN_H__
@@ -0,0 +1,182 @@
+/*
+ * simtest.c - regression test of homing, going to center & step rates
+ *             on simulated motors in virtual time (exit status != 0 if failed)
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+// stepper.c is included to reach its tables of axes & simulated motors
+#include "stepper.c"
+#include <math.h>
+
+// wall time limit of waiting for motors (virtual time runs much faster), ms
+#define WAIT_MS     (10000)
+// slow speed for measurement of achieved rate (move is longer than 1s)
+#define SLOW_SPEED  (100)
+
+static int failed = 0;
+static const volatile int never = 0;
+
+#define CHECK(cond, ...) do{ if(!(cond)){ ++failed; printf("FAIL: " __VA_ARGS__); printf("\n"); } }while(0)
+
+/**
+ * Wait until center_reached is set
+ * @return 0 if center reached
+ */
+static int wait_center(){
+	int i;
+	for(i = 0; i < WAIT_MS && !center_reached; ++i) usleep(1000);
+	return center_reached ? 0 : 1;
+}
+
+static unsigned long sim_lost(int axis){
+	sim_motor m;
+	if(sim_get_motor(simmotor[axis], &m)) return 0;
+	return m.lost;
+}
+
+/**
+ * Check position of axis by state & by simulated motor
+ */
+static void check_position(const char *stage, int axis, long expected){
+	sim_motor m;
+	long pos, zero = (eswpin[axis] < 0) ? 0 : SIM_ESWPOS;
+	int homed = get_position(axis, &pos);
+	CHECK(homed, "%s: %c isn't homed", stage, axes[axis].name);
+	CHECK(pos == expected, "%s: %c at %ld instead of %ld", stage, axes[axis].name, pos, expected);
+	if(sim_get_motor(simmotor[axis], &m)) return;
+	// zero by end-switch is where it's pressed at slow speed: one pulse of tolerance
+	CHECK(labs(m.pos - zero - pos) <= 1, "%s: simulated %c is at %ld, position %ld (zero %ld)",
+		stage, axes[axis].name, m.pos, pos, zero);
+}
+
+/**
+ * Go to center & check positions of both axes & lost pulses
+ * @param lost - pulses can be lost (homing to mechanical stop)
+ */
+static void center(const char *stage, int lost){
+	unsigned long lost0[NAXES];
+	int i;
+	for(i = 0; i < NAXES; ++i) lost0[i] = sim_lost(i);
+	center_reached = 0;
+	XY_gotocenter();
+	if(wait_center()){
+		CHECK(0, "%s: center isn't reached", stage);
+		return;
+	}
+	for(i = 0; i < NAXES; ++i){
+		check_position(stage, i, tocenter[i]);
+		if(!lost)
+			CHECK(sim_lost(i) == lost0[i], "%s: %c lost %lu pulses", stage, axes[i].name,
+				sim_lost(i) - lost0[i]);
+	}
+	printf("%s: done\n", stage);
+}
+
+/**
+ * Move axis & return virtual time of move (ns)
+ */
+static int64_t timed_move(int axis, int dir, unsigned int N){
+	struct timespec t0, t1;
+	clock_now(&t0);
+	if(move(axis, dir, N)) return -1;
+	wait_axis_stop(axis, &never);
+	clock_now(&t1);
+	return ts_diff(&t1, &t0);
+}
+
+/**
+ * Duration of move of N pulses by plan of motion engine (ns)
+ */
+static int64_t planned_time(int axis, int vmax, unsigned int N){
+	static ramp_t r;
+	unsigned int k, na, nd;
+	int64_t t = 0;
+	make_ramp(&r, &axes[axis].profile, vmax, axes[axis].ppstep);
+	plan_move(&r, &axes[axis].profile, N, &na, &nd);
+	for(k = 0; k < N; ++k) t += ramp_period(&r, k, N, na, nd);
+	return t;
+}
+
+/**
+ * Max speed moves are as fast as planned & don't lose pulses,
+ * achieved rate of long move is the requested one
+ */
+static void rates(){
+	unsigned long lost0 = sim_lost(0);
+	unsigned int N = tocenter[0] - 100;
+	double req, ach;
+	int64_t t, plan;
+	motion_profile prof;
+	int old = get_motors_speed();
+	set_motors_speed(MAX_SPEED);
+	CHECK(get_motors_speed() == old, "speed %d above limit is accepted", MAX_SPEED);
+	set_motors_speed(MAX_SPEED - 1);
+	CHECK(get_motors_speed() == MAX_SPEED - 1, "max speed %d isn't accepted", MAX_SPEED - 1);
+	// profiles have the same ceiling
+	prof = axes[0].profile;
+	prof.vmax = MAX_SPEED;
+	CHECK(set_motion_profile(0, &prof) == 2, "profile with speed %d is accepted", MAX_SPEED);
+	prof.vmax = MAX_SPEED - 1;
+	CHECK(set_motion_profile(0, &prof) == 0, "profile with speed %d isn't accepted", MAX_SPEED - 1);
+	plan = planned_time(0, MAX_SPEED - 1, N);
+	t = timed_move(0, -1, N);
+	CHECK(t > 0 && llabs(t - plan) < plan / 50, "move on max speed: %.3fs instead of %.3fs",
+		t / 1e9, plan / 1e9);
+	CHECK(sim_lost(0) == lost0, "%lu pulses lost on max speed", sim_lost(0) - lost0);
+	printf("max speed %d: %u pulses in %.3fs (planned %.3fs)\n", MAX_SPEED - 1, N, t / 1e9, plan / 1e9);
+	set_motors_speed(SLOW_SPEED);
+	clear_jitter();
+	t = timed_move(0, 1, N);
+	get_step_rate(0, &req, &ach);
+	CHECK(fabs(ach - SLOW_SPEED) < SLOW_SPEED * 0.02, "achieved rate %.1f instead of %d", ach, SLOW_SPEED);
+	CHECK(sim_lost(0) == lost0, "%lu pulses lost on slow speed", sim_lost(0) - lost0);
+	printf("speed %d: achieved %.1f steps/s\n", SLOW_SPEED, ach);
+	set_motors_speed(old);
+}
+
+int main(){
+	pthread_t thread;
+	int i;
+	gpio_simulate = 1;
+	rtparams.virtime = 1;
+	unlink(STATE_FILE); // cold start: positions are unknown
+	pthread_create(&thread, NULL, steppers_thread, NULL);
+	for(i = 0; i < WAIT_MS && !steppers_ready(); ++i) usleep(1000);
+	if(!steppers_ready()){
+		printf("FAIL: motors aren't ready\n");
+		return 1;
+	}
+	// homing by end-switch or mechanical stop (pulses are lost on it)
+	XY_home();
+	center("homing", 1);
+	// known positions: straight to center
+	CHECK(!move_to(0, tocenter[0] / 3) && !move_to(1, tocenter[1] * 3 / 2), "can't move to position");
+	wait_axis_stop(0, &never);
+	wait_axis_stop(1, &never);
+	center("go to center", 0);
+	// moving axes are stopped first
+	Xmove(-1, tocenter[0] / 2);
+	Ymove(1, tocenter[1] / 2);
+	center("go to center while moving", 0);
+	rates();
+	center("go to center after rates", 0);
+	unlink(STATE_FILE);
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed ? 1 : 0;
+}
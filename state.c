@@ -0,0 +1,113 @@
+/*
+ * state.c - positions of axes in memory-mapped file: they are updated by
+ *           steppers' thread without any syscalls & survive restarts
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "state.h"
+
+// state mapped by supervisor before fork is inherited by all its children
+static motion_state *shared = NULL;
+
+static int64_t now_ns(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * Map state file (create it if there's no file or it's broken),
+ * file is mapped only once: next calls return the same mapping
+ * @param path  - file name
+ * @param naxes - amount of axes
+ * @return pointer to mapped state or NULL in case of error
+ */
+motion_state *state_open(const char *path, int naxes){
+	motion_state *st;
+	int fd;
+	if(shared) return shared;
+	if(naxes < 1 || naxes > STATE_MAXAXES) return NULL;
+	if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0){
+		perror("open()");
+		return NULL;
+	}
+	if(ftruncate(fd, sizeof(motion_state))){
+		perror("ftruncate()");
+		close(fd);
+		return NULL;
+	}
+	st = mmap(NULL, sizeof(motion_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(st == MAP_FAILED){
+		perror("mmap()");
+		return NULL;
+	}
+	if(st->magic != STATE_MAGIC || st->naxes != (uint32_t)naxes){
+		printf("Initialize state file %s\n", path);
+		memset(st, 0, sizeof(motion_state));
+		st->naxes = naxes;
+		st->magic = STATE_MAGIC;
+	}
+	shared = st;
+	return st;
+}
+
+/**
+ * @return mapped state or NULL
+ */
+motion_state *state_get(){
+	return shared;
+}
+
+/**
+ * Start of supervisor: forget all except positions
+ */
+void state_cold(){
+	if(!shared) return;
+	shared->speed = 0;
+	shared->lamps = 0;
+	memset(&shared->job, 0, sizeof(state_job));
+	shared->restarts = 0;
+	shared->started = 0;
+	shared->ready = 0;
+}
+
+/**
+ * Supervisor (re)starts child
+ */
+void state_start(){
+	if(!shared) return;
+	if(shared->started) ++shared->restarts;
+	shared->started = now_ns();
+}
+
+/**
+ * Child is ready to work: store & show time from its (re)start
+ */
+void state_ready(){
+	if(!shared || !shared->started) return;
+	shared->ready = now_ns() - shared->started;
+	printf("Ready in %.1fms after %s\n", shared->ready / 1e6, shared->restarts ? "restart" : "start");
+}
@@ -0,0 +1,71 @@
+/*
+ * state.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stdint.h>
+
+// file with positions of axes & instrument state, it's mapped by supervisor
+// (so restarted child resumes from it) & positions survive restarts of controller
+#ifndef STATE_FILE
+	#define STATE_FILE  "/tmp/rasp-spect.state"
+#endif
+
+#define STATE_MAGIC     (0x53505855)
+#define STATE_MAXAXES   (4)
+
+// active job: none, scan, differential frames or sequence (rasp-spect_another_model)
+#define STATE_JOB_NONE  (0)
+#define STATE_JOB_SCAN  ('C')
+#define STATE_JOB_DIFF  ('F')
+#define STATE_JOB_SEQ   ('Q')
+// job isn't resumed after so many restarts without progress
+#define STATE_JOB_TRIES (3)
+
+typedef struct{
+	int32_t type;                    // STATE_JOB_*
+	int32_t args[4];                 // parameters of job as in command
+	int32_t done;                    // frames (pairs) sent
+	int32_t tries;                   // restarts since last frame
+} state_job;
+
+typedef struct{
+	uint32_t magic;                  // STATE_MAGIC
+	uint32_t naxes;                  // amount of axes in file
+	int32_t pos[STATE_MAXAXES];      // absolute positions (pulses), written by steppers' thread
+	int32_t homed[STATE_MAXAXES];    // !0 - position is known
+	// kept over restarts of child only
+	int32_t speed;                   // max speed of motors (0 - default)
+	int32_t lamps;                   // lamps turned on: bit 0 - lamp 1, bit 1 - lamp 2
+	state_job job;
+	uint32_t restarts;               // amount of restarts of child
+	int64_t started;                 // time of (re)start of child, CLOCK_MONOTONIC ns
+	int64_t ready;                   // time from (re)start to ready state, ns
+} motion_state;
+
+motion_state *state_open(const char *path, int naxes);
+motion_state *state_get();
+void state_cold();
+void state_start();
+void state_ready();
+
+#endif // __STATE_H__
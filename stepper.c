@@ -1,5 +1,5 @@
 /*
- * stepper.c - functions for working with stepper motors by wiringPi
+ * stepper.c - functions for working with stepper motors through GPIO
  *
  * Copyright 2015 Edward V. Emelianoff <eddy@sao.ru>
  *
@@ -24,15 +24,16 @@
 #include <time.h>			// time
 #include <string.h>			// memcpy
 #include <stdint.h>			// int types
-#include <sys/time.h>		// gettimeofday
 #define X_OPEN_SOURCE 999
 #include <unistd.h>			// usleep
-// use wiringPi on ARM & simple echo on PC (for tests)
-#ifdef __arm__
-	#include <wiringPi.h>
-#endif
+#include <pthread.h>
 
 #include "stepper.h"
+#include "gpio.h"
+#include "rtsched.h"
+#include "motion.h"
+#include "state.h"
+#include "trace.h"
 
 /*
  * Pins definition (used BROADCOM GPIO pins numbering)
@@ -45,6 +46,25 @@
 #define Y_EN_PIN	(25)
 #define Y_DIR_PIN	(8)
 #define Y_CLK_PIN	(7)
+// calibration lamps (active low): GPIO5 (leg29), GPIO6 (leg31); they're used only
+// if board has them (make DEFINES+=-DLAMPS), -1 - there's no lamp
+#ifdef LAMPS
+#define LAMP1_PIN	(5)
+#define LAMP2_PIN	(6)
+#else
+#define LAMP1_PIN	(-1)
+#define LAMP2_PIN	(-1)
+#endif
+// end-switches at zero (active low, pulled up): GPIO17 (leg11), GPIO27 (leg13);
+// they're used only if board has them (make DEFINES+=-DENDSWITCHES), -1 - there's
+// no switch & homing goes to mechanical stop
+#ifdef ENDSWITCHES
+#define X_ESW_PIN	(17)
+#define Y_ESW_PIN	(27)
+#else
+#define X_ESW_PIN	(-1)
+#define Y_ESW_PIN	(-1)
+#endif
 
 // amount of steps to zero (max inclination, dir = -1) and center (dir = 1)
 //#define X_TOZERO_STEPS   (4500)
@@ -56,260 +76,467 @@
 //#define Y_TOCENTER_STEPS (3450)
 #define Y_TOCENTER_STEPS (2800)
 
-// max speed in steps per second
+// ceiling of speeds (steps per second): speeds set by user (S command & profiles)
+// should be less than it, internal moves can't be faster than it
 #define MAX_SPEED  (500)
+// speed of homing & going to center
+#define HOMING_SPEED (MAX_SPEED)
+#if HOMING_SPEED > MAX_SPEED
+	#error "HOMING_SPEED is above MAX_SPEED"
+#endif
+// speed of slow approach to end-switch
+#define HOMING_SLOW_SPEED  (50)
+// pulses to move back from end-switch before slow approach
+#define HOMING_BACKSTEPS   (80)
+// end-switch should hold its level for this time (us)
+#define ESW_DEBOUNCE       (2000)
+// default start/stop speed & acceleration (steps/s, steps/s^2)
+#define DEFAULT_V0     (50)
+#define DEFAULT_ACCEL  (2000)
+// CLK pulses (microsteps) per step
+#define USTEPS     (8)
+// simulated motors stall when speed is higher (steps per second)
+#define SIM_MAXRATE  (1200)
+// simulated end-switch is pressed so much pulses before mechanical stop
+#define SIM_ESWPOS   (200)
 #ifndef _U_
 	#define _U_  __attribute__((__unused__))
 #endif
 
 int center_reached = 0;
+int stepspersec = 50;
+
+static void on_stop(axis_t *a);
+
+// table of axes
+static axis_t axes[] = {
+	{.name = 'X', .drive = DRIVE_STEPDIR, .pins = {X_EN_PIN, X_DIR_PIN, X_CLK_PIN, -1},
+		.ppstep = USTEPS, .profile = {DEFAULT_V0, 50, DEFAULT_ACCEL, DEFAULT_ACCEL, 0},
+		.on_stop = on_stop},
+	{.name = 'Y', .drive = DRIVE_STEPDIR, .pins = {Y_EN_PIN, Y_DIR_PIN, Y_CLK_PIN, -1},
+		.ppstep = USTEPS, .profile = {DEFAULT_V0, 50, DEFAULT_ACCEL, DEFAULT_ACCEL, 0},
+		.on_stop = on_stop}
+};
+#define NAXES  (int)(sizeof(axes) / sizeof(axes[0]))
+
+// stages of going to center: 1 - to zero, 2 - to center, 3 - wait until axis stops
+static int gotocenter[NAXES];
+static const unsigned int tozero[NAXES] = {X_TOZERO_STEPS, Y_TOZERO_STEPS};
+static const unsigned int tocenter[NAXES] = {X_TOCENTER_STEPS, Y_TOCENTER_STEPS};
+static const int eswpin[NAXES] = {X_ESW_PIN, Y_ESW_PIN};
+static const int lamppin[2] = {LAMP1_PIN, LAMP2_PIN};
+
+// absolute positions (zero is mechanical stop)
+static motion_state *state = NULL;
+static motion_state nostate; // used if state file can't be mapped
+static volatile int ready = 0;
+static void (*notify)() = NULL;
+// threads waiting for stop of axes
+static pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
 
-#ifdef __arm__
 /**
- * function for different purposes that need to know time intervals
- * @return double value: time in seconds
+ * Set function called by steppers' thread when motors are set up or some axis stops
+ * (should be set before start of steppers' thread)
  */
-static double dtime(){
-	double t;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	t = tv.tv_sec + ((double)tv.tv_usec)/1e6;
-	return t;
+void steppers_notify(void (*fn)()){
+	notify = fn;
 }
 
-void Write(int pin, int val){
-	if(val) val = 1;
-	digitalWrite(pin, val);
-	while(digitalRead(pin) != val);
-}
-#endif // __arm__
-
 /**
  * Exit & return terminal to old state
  * @param ex_stat - status (return code)
  */
 void steppers_relax(){
 	printf("Stop Steppers\n");
-#ifdef __arm__
 	// disable motor & all other
-	Write(X_EN_PIN, 0);Write(X_DIR_PIN, 1);Write(X_CLK_PIN, 1);
-	Write(Y_EN_PIN, 0);Write(Y_DIR_PIN, 1);Write(Y_CLK_PIN, 1);
-#endif // __arm__
+	motion_relax();
 }
 
 
-void setup_motors(){
-#ifdef __arm__
-	wiringPiSetupGpio();
-	pinMode(X_EN_PIN, OUTPUT);
-	pinMode(X_DIR_PIN, OUTPUT);
-	pinMode(X_CLK_PIN, OUTPUT);
-	pinMode(Y_EN_PIN, OUTPUT);
-	pinMode(Y_DIR_PIN, OUTPUT);
-	pinMode(Y_CLK_PIN, OUTPUT);
-	Write(X_EN_PIN, 0);
-	Write(Y_EN_PIN, 0);
-	Write(X_CLK_PIN, 1);
-	Write(Y_CLK_PIN, 1);
-	Write(X_DIR_PIN, 1);
-	Write(Y_DIR_PIN, 1);
-#else // __arm__
-	printf("Setup GPIO\n");
-#endif // __arm__
-}
-
-#ifdef __arm__
-int running[2] = {0,0}, stepspersec = 50;
-int gotocenter[2] = {0,0};
-unsigned int steps[2] = {0,0}, stopat[2] = {0,0};
-volatile double halfsteptime;
-#endif // __arm__
+// simulated motors: start from center, zero position is end-switch (if any) or mechanical stop
+static int simmotor[NAXES];
+static void setup_simulation(){
+	int i;
+	for(i = 0; i < NAXES; ++i){
+		long zero = (eswpin[i] < 0) ? 0 : SIM_ESWPOS;
+		sim_motor m = {SIM_STEPDIR, {axes[i].pins[0], axes[i].pins[1], axes[i].pins[2], -1},
+			(state->homed[i] ? state->pos[i] : (long)tocenter[i]) + zero, 0, 2*tocenter[i],
+			{eswpin[i], -1}, {zero, 0}, SIM_MAXRATE * USTEPS, 0, 0, 0};
+		simmotor[i] = sim_add_motor(&m);
+	}
+}
 
 /**
- * Rotate motors X,Y to direction dir (CW > 0)
- * Stop motor if dir == 0
+ * Show position of simulated motor when it stops
  */
-void move_X(int dir){
-	if(dir == 0){ // stop
-#ifdef __arm__
-		Write(X_EN_PIN, 0); // disable motor
-		running[0] = 0;
-		if(gotocenter[0]){
-			switch(gotocenter[0]){
-				case 1: // first stage of going to center -> turn it to second
-					gotocenter[0] = 2;
-					Xmove(1, X_TOCENTER_STEPS);
-				break;
-				case 2: // second stage -> all OK
-				default:
-					gotocenter[0] = 0;
-					if(gotocenter[1] == 0){ // restore speed when all stopt
-						halfsteptime = 1. / (stepspersec * 8. * 2.);
-						center_reached = 1;
-					}
-			}
-		}
-#else // __arm__
-		printf("Stop X motor\n");
-#endif // __arm__
-	}else{
-#ifdef __arm__
-		Write(X_EN_PIN, 1); // enable motor
-		Write(X_DIR_PIN, (dir>0)? 0:1); // CW - >0, CCW - <0
-		running[0] = 1;
-#else // __arm__
-		printf("Move X to %s\n", (dir > 0) ? "++" : "--");
-#endif // __arm__
+static void sim_stopped(int axis){
+	sim_motor m;
+	if(!gpio_simulate || sim_get_motor(simmotor[axis], &m)) return;
+	printf("Simulated %c motor stops at %ld (lost %lu pulses)\n", axes[axis].name, m.pos, m.lost);
+}
+
+/**
+ * Map state of instrument (supervisor calls it before starting of child,
+ * so restarted child gets the same state)
+ */
+void steppers_open_state(){
+	if(state) return;
+	if(!(state = state_open(STATE_FILE, NAXES))){
+		fprintf(stderr, "Can't map " STATE_FILE ", positions won't be saved\n");
+		state = &nostate;
 	}
 }
-void move_Y(int dir){
-	if(dir == 0){ // stop
-#ifdef __arm__
-		Write(Y_EN_PIN, 0); // disable motor
-		running[1] = 0;
-		if(gotocenter[1]){
-			switch(gotocenter[1]){
-				case 1: // first stage of going to center -> turn it to second
-					gotocenter[1] = 2;
-					Ymove(1, Y_TOCENTER_STEPS);
-				break;
-				case 2: // second stage -> all OK
-				default:
-					gotocenter[1] = 0;
-					if(gotocenter[0] == 0){
-						halfsteptime = 1. / (stepspersec * 8. * 2.);
-						center_reached = 1;
-					}
-			}
-		}
-#else // __arm__
-		printf("Stop Y motor\n");
-#endif // __arm__
-	}else{
-#ifdef __arm__
-		Write(Y_EN_PIN, 1); // enable motor
-		Write(Y_DIR_PIN, (dir>0)? 0:1); // CW - >0, CCW - <0
-		running[1] = 1;
-#else // __arm__
-		printf("Move Y to %s\n", (dir > 0) ? "++" : "--");
-#endif // __arm__
+
+void setup_motors(){
+	int i;
+	gpio_setup();
+	printf("GPIO backend: %s\n", gpio_backend());
+	steppers_open_state();
+	for(i = 0; i < NAXES; ++i){
+		axes[i].pos = &state->pos[i];
+		if(state->homed[i]) printf("%c position: %d\n", axes[i].name, state->pos[i]);
+	}
+	motion_setup(axes, NAXES);
+	// lamps & speed after restart are the same as before
+	for(i = 0; i < 2; ++i){
+		if(lamppin[i] < 0) continue;
+		gpio_mode(lamppin[i], GPIO_OUT);
+		gpio_write(lamppin[i], !(state->lamps & (1 << i))); // active low
 	}
+	if(state->speed) set_motors_speed(state->speed);
+	if(gpio_simulate) setup_simulation();
+	for(i = 0; i < NAXES; ++i)
+		if(eswpin[i] > -1 && axis_limit(&axes[i], -1, eswpin[i], ESW_DEBOUNCE))
+			fprintf(stderr, "Can't watch %c end-switch, homing by mechanical stop\n", axes[i].name);
+	ready = 1;
+	if(notify) notify();
+}
+
+/**
+ * @return !0 when motors are set up
+ */
+int steppers_ready(){
+	return ready;
 }
 
 /**
- * Move motors in direction dir to Nsteps
+ * Move axis in direction dir to Nsteps
  * (if Nsteps == 0 then move infinitely)
+ * dir == 0 - stop motor with deceleration
+ * @return 0 if all OK, 1 if axis is moving already
  */
-void Xmove(int dir, unsigned int Nsteps){
-#ifdef __arm__
-	if(dir == 0) printf("X stops at %d steps\n", steps[0]);
-	steps[0] = 0;
-#endif // __arm__
-	if(Nsteps == 0){
-#ifdef __arm__
-		stopat[0] = 0;
-#endif // __arm__
-		move_X(dir);
-	}else{
-#ifdef __arm__
-		stopat[0] = Nsteps;
-		move_X(dir);
-#endif // __arm__
+static int move(int i, int dir, unsigned int Nsteps){
+	if(dir == 0){
+		trace(TR_STOP, axes[i].name, axes[i].steps);
+		axis_flush(&axes[i]);
+	}else trace(TR_MOVE, axes[i].name, (int64_t)dir * Nsteps);
+	return axis_move(&axes[i], dir, Nsteps, gotocenter[i] ? HOMING_SPEED : axes[i].profile.vmax);
+}
+
+/**
+ * Start going of stopped axis to center: from known position move to it at once,
+ * else go to end-switch or mechanical stop first
+ * @return 0 if axis is in center already
+ */
+static int center_start(int i){
+	long d;
+	if(!state->homed[i]){
+		gotocenter[i] = 1;
+		// two-speed homing by end-switch, without it go to mechanical stop
+		if(axis_home(&axes[i], -1, HOMING_SPEED, HOMING_SLOW_SPEED, HOMING_BACKSTEPS))
+			move(i, -1, tozero[i]);
+		return 1;
 	}
+	d = (long)tocenter[i] - state->pos[i];
+	gotocenter[i] = d ? 2 : 0;
+	if(d) move(i, (d > 0) ? 1 : -1, labs(d));
+	return gotocenter[i];
 }
-void Ymove(int dir, unsigned int Nsteps){
-#ifdef __arm__
-	if(dir == 0) printf("Y stops at %d steps\n", steps[1]);
-	steps[1] = 0;
-#endif // __arm__
-	if(Nsteps == 0){
-#ifdef __arm__
-		stopat[1] = 0;
-#endif // __arm__
-		move_Y(dir);
-	}else{
-#ifdef __arm__
-		stopat[1] = Nsteps;
-		move_Y(dir);
-#endif // __arm__
+
+/**
+ * Axis stopped: go to next stage of going to center
+ * (called from steppers' thread)
+ */
+static void on_stop(axis_t *a){
+	int i, axis = a - axes;
+	trace(TR_STOPPED, a->name, a->steps);
+	sim_stopped(axis);
+	steppers_wake();
+	switch(gotocenter[axis]){
+		case 0:
+		break;
+		case 1: // first stage of going to center -> turn it to second
+			if(a->homing == HOMING_FAILED){
+				trace(TR_HOMING_FAILED, a->name, 0);
+				gotocenter[axis] = 0;
+				return;
+			}
+			// axis is on end-switch or mechanical stop: now position is known
+			state->pos[axis] = 0;
+			state->homed[axis] = 1;
+			gotocenter[axis] = 2;
+			move(axis, 1, tocenter[axis]);
+		break;
+		case 3: // axis was moving: now it can go to center
+			if(center_start(axis)) break;
+			// fall through
+		case 2: // second stage -> all OK
+		default:
+			gotocenter[axis] = 0;
+			for(i = 0; i < NAXES; ++i)
+				if(gotocenter[i]) return;
+			center_reached = 1;
 	}
+	if(notify) notify(); // next queued move or message
+}
+
+void Xmove(int dir, unsigned int Nsteps){
+	move(0, dir, Nsteps);
+}
+void Ymove(int dir, unsigned int Nsteps){
+	move(1, dir, Nsteps);
+}
+
+/**
+ * Coordinated linear move of both axes, so they arrive together
+ * @param dx, dy - amount of steps by each axis, sign is direction
+ * @return 0 if all OK, 1 if motors are busy
+ */
+int XYmove(long dx, long dy){
+	if(gotocenter[0] || gotocenter[1]) return 1;
+	return axis_line(&axes[0], &axes[1], dx, dy);
 }
 
+/**
+ * Go to center: from known position move to it at once,
+ * else go to mechanical stop first; moving axes are stopped before
+ */
 void XY_gotocenter(){
-#ifdef __arm__
-	gotocenter[0] = gotocenter[1] = 1;
-	halfsteptime = 1. / (MAX_SPEED * 8. * 2.);
-	Xmove(-1, X_TOZERO_STEPS);
-	Ymove(-1, Y_TOZERO_STEPS);
-#else // __arm__
-	printf("Go to center\n");
-#endif // __arm__
+	int i;
+	// all flags should be set before any axis can stop
+	for(i = 0; i < NAXES; ++i){
+		axis_flush(&axes[i]);
+		gotocenter[i] = 3;
+	}
+	for(i = 0; i < NAXES; ++i){
+		if(axes[i].running || axes[i].leader) axis_soft_stop(&axes[i]); // on_stop continues
+		else center_start(i);
+	}
+	for(i = 0; i < NAXES; ++i)
+		if(gotocenter[i]) return;
+	center_reached = 1; // already there
+}
+
+/**
+ * Forget positions & go to center through homing
+ */
+void XY_home(){
+	int i;
+	for(i = 0; i < NAXES; ++i) state->homed[i] = 0;
+	XY_gotocenter();
+}
+
+/**
+ * Get absolute position of axis
+ * @return 0 if position is unknown
+ */
+int get_position(int axis, long *pos){
+	if(axis < 0 || axis >= NAXES) return 0;
+	*pos = __atomic_load_n(&state->pos[axis], __ATOMIC_RELAXED);
+	return state->homed[axis];
+}
+
+/**
+ * @return !0 if axis is moving now
+ */
+int axis_moving(int axis){
+	if(axis < 0 || axis >= NAXES) return 0;
+	return axes[axis].running;
+}
+
+/**
+ * Wait until axis stops
+ * @param cancel - waiting is interrupted when it becomes !0 (& steppers_wake() is called)
+ * @return 0 if axis stopped, 1 if waiting is cancelled
+ */
+int wait_axis_stop(int axis, const volatile int *cancel){
+	if(axis < 0 || axis >= NAXES) return 0;
+	pthread_mutex_lock(&stop_mutex);
+	// running is cleared before on_stop() broadcasts, so wakeup can't be lost
+	while(axes[axis].running && !*cancel) pthread_cond_wait(&stop_cond, &stop_mutex);
+	pthread_mutex_unlock(&stop_mutex);
+	return *cancel ? 1 : 0;
+}
+
+/**
+ * Wake up all threads waiting in wait_axis_stop() (some axis stopped or waiting is cancelled)
+ */
+void steppers_wake(){
+	pthread_mutex_lock(&stop_mutex);
+	pthread_cond_broadcast(&stop_cond);
+	pthread_mutex_unlock(&stop_mutex);
+}
+
+/**
+ * Move axis to absolute position
+ * @return 0 if all OK, 1 if motor is busy, 2 if position is unknown
+ */
+int move_to(int axis, long pos){
+	long d;
+	if(axis < 0 || axis >= NAXES || !state->homed[axis]) return 2;
+	if(axes[axis].running || gotocenter[axis]) return 1;
+	d = pos - state->pos[axis];
+	if(d) move(axis, (d > 0) ? 1 : -1, labs(d));
+	return 0;
+}
+
+/**
+ * Coordinated move of both axes to absolute position
+ * @return 0 if all OK, 1 if motors are busy, 2 if position is unknown
+ */
+int XYmove_to(long x, long y){
+	if(!state->homed[0] || !state->homed[1]) return 2;
+	return XYmove(x - state->pos[0], y - state->pos[1]);
+}
+
+/**
+ * Put move of axis into queue
+ * @param d        - amount of steps (sign is direction) or absolute position
+ * @param relative - !0 if d is amount of steps
+ * @return 0 if all OK, 1 if queue is full or axis is busy, 2 if position is unknown
+ */
+int queue_move(int axis, long d, int relative){
+	long end;
+	if(axis < 0 || axis >= NAXES) return 2;
+	if(gotocenter[axis]) return 1;
+	if(!relative){
+		if(!state->homed[axis] || !axis_queue_end(&axes[axis], &end)) return 2;
+		d -= end;
+	}
+	return axis_queue(&axes[axis], d);
+}
+
+/**
+ * Execute queued moves (called by main thread)
+ */
+void steppers_poll(){
+	motion_poll();
 }
 
+/**
+ * Set max speed of all motors (will be used since next move)
+ */
 void set_motors_speed(int steps_per_sec){
+	int i;
 	if(steps_per_sec > 0 && steps_per_sec < MAX_SPEED){
-#ifdef __arm__
+		for(i = 0; i < NAXES; ++i)
+			axes[i].profile.vmax = steps_per_sec;
 		stepspersec = steps_per_sec;
-		halfsteptime = 1. / (stepspersec * 8. * 2.);
-#else // __arm__
-		printf("Set speed to %d\n", steps_per_sec);
-#endif // __arm__
+		if(state) state->speed = steps_per_sec;
 	}
 }
 
 int get_motors_speed(){
-#ifdef __arm__
 	return stepspersec;
-#else // __arm__
-	return 111;
-#endif // __arm__
 }
 
-/*
-#ifdef __arm__
-#else // __arm__
-#endif // __arm__
-*/
+/**
+ * Change acceleration profile of axis (will be used since next move)
+ * @param axis - 0 for X, 1 for Y
+ * @return 0 if all OK
+ */
+int set_motion_profile(int axis, motion_profile *p){
+	if(axis < 0 || axis >= NAXES) return 1;
+	if(p->v0 < 1 || p->vmax < p->v0 || p->vmax >= MAX_SPEED) return 2;
+	if(p->accel < 1 || p->decel < 1) return 3;
+	axes[axis].profile = *p;
+	if(axes[axis].profile.scurve) axes[axis].profile.scurve = 1;
+	return 0;
+}
+
+void get_motion_profile(int axis, motion_profile *p){
+	if(axis < 0 || axis >= NAXES) return;
+	*p = axes[axis].profile;
+}
+
+/**
+ * Get requested & really achieved (in last second of moving) speed
+ * @param axis      - 0 for X, 1 for Y
+ * @param requested - steps per second by current pulse period
+ * @param achieved  - measured steps per second
+ * @return amount of missed deadlines
+ */
+unsigned int get_step_rate(int axis, double *requested, double *achieved){
+	if(axis < 0 || axis >= NAXES) return 0;
+	return axis_rate(&axes[axis], requested, achieved);
+}
+
+/**
+ * Get statistics of pulses lateness
+ * @return 0 if all OK
+ */
+int get_jitter(int axis, jitter_stat *s){
+	if(axis < 0 || axis >= NAXES) return 1;
+	jitter_get(&axes[axis].jitter, s);
+	return 0;
+}
+
+void clear_jitter(){
+	int i;
+	for(i = 0; i < NAXES; ++i) jitter_clear(&axes[i].jitter);
+}
+
+/**
+ * @return CPU usage of steppers' thread (percents) since previous call
+ */
+double get_steppers_cpu(){
+	return motion_cpu_usage();
+}
+
+/**
+ * @return !0 if lamp with number nlamp (1 or 2) is fitted
+ */
+int lamp_fitted(int nlamp){
+	return (nlamp == 1 || nlamp == 2) && lamppin[nlamp - 1] > -1;
+}
+
+/**
+ * Turn on/off (on == 1/0) lamp with number nlamp (1 or 2)
+ */
+void set_lamp(int nlamp, int on){
+	if(!lamp_fitted(nlamp)) return;
+	gpio_write(lamppin[nlamp - 1], !on);
+	if(!state) return;
+	if(on) __atomic_or_fetch(&state->lamps, nlamp, __ATOMIC_RELAXED);
+	else __atomic_and_fetch(&state->lamps, ~nlamp, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return state of lamps: 0 - both off, 1 - lamp 1 on, 2 - lamp 2 on, 3 - both on
+ */
+int getlamp(){
+	uint32_t lev = gpio_read_all();
+	int i, ret = 0;
+	for(i = 0; i < 2; ++i)
+		if(lamppin[i] > -1 && !(lev & PINMASK(lamppin[i]))) ret |= 1 << i;
+	return ret;
+}
 
 /**
  * Main thread for steppers management
+ * Each axis has its own deadline of next pulse, thread sleeps until nearest
  */
 void *steppers_thread(_U_ void *buf){
-#ifdef __arm__
-	int i = 1;
-	double laststeptime, curtime;
-	halfsteptime = 1. / (stepspersec * 8. * 2.); // 300 steps & 8 usteps per second
+	trace_thread("steppers");
 	setup_motors();
-	laststeptime = dtime();
-	while(1){
-		usleep(10); // garanteed pause == 10us
-		if(running[0] || running[1]){
-			if((curtime = dtime()) - laststeptime > halfsteptime){
-				i ^= 1;
-				if(running[0]){ // X motor
-					Write(X_CLK_PIN, i);
-					if(i){
-						if(stopat[0] && stopat[0] == steps[0])
-							move_X(0); // stop motor at destination
-						else
-							steps[0]++;
-					}
-				}
-				if(running[1]){ // Y motor
-					Write(Y_CLK_PIN, i);
-					if(i){
-						if(stopat[1] && stopat[1] == steps[1])
-							move_Y(0); // stop motor at destination
-						else
-							steps[1]++;
-					}
-				}
-				laststeptime = curtime;
-			}
-		}
-	}
-#else // __arm__
-	printf("Main steppers' thread\n");
-	while(1) usleep(1000);
-#endif // __arm__
+	motion_loop(NULL);
+	return NULL;
+}
+
+/**
+ * Stop steppers' thread (join it after this call)
+ */
+void steppers_stop(){
+	motion_stop();
 }
@@ -23,14 +23,41 @@
 #ifndef __STEPPER_H__
 #define __STEPPER_H__
 
+#include "profile.h"
+#include "rtsched.h"
+
 extern int center_reached;
 
 void steppers_relax();
+void steppers_stop();
 void *steppers_thread(void *buf);
 void Xmove(int dir, unsigned int Nsteps);
 void Ymove(int dir, unsigned int Nsteps);
 void set_motors_speed(int steps_per_sec);
 int get_motors_speed();
+unsigned int get_step_rate(int axis, double *requested, double *achieved);
+int get_jitter(int axis, jitter_stat *s);
+void clear_jitter();
+double get_steppers_cpu();
+int set_motion_profile(int axis, motion_profile *p);
+void get_motion_profile(int axis, motion_profile *p);
+int XYmove(long dx, long dy);
+int XYmove_to(long x, long y);
+int move_to(int axis, long pos);
+int get_position(int axis, long *pos);
+int axis_moving(int axis);
+int wait_axis_stop(int axis, const volatile int *cancel);
+void steppers_wake();
+int queue_move(int axis, long d, int relative);
+void steppers_poll();
 void XY_gotocenter();
+void XY_home();
+int lamp_fitted(int nlamp);
+void set_lamp(int nlamp, int on);
+void steppers_open_state();
+void setup_motors();
+int steppers_ready();
+void steppers_notify(void (*fn)());
+int getlamp();
 
 #endif // __STEPPER_H__
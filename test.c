@@ -507,7 +507,7 @@ int main(_U_ int argc, _U_ char **argv){
 		pthread_mutex_unlock(&command_mutex);
 		usleep(100); // give another treads some time to fill buffer
 	}
-	pthread_cancel(s_thread); // cancel steppers' thread
+	steppers_stop();
 	pthread_join(s_thread, NULL);
 	steppers_relax();
 	pthread_join(w_thread, NULL); // wait for closing of libsockets thread
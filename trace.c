@@ -0,0 +1,224 @@
+/*
+ * trace.c - flight recorder: each thread writes binary timestamped events into
+ *           its own ring in shared memory, text is made only by dump
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define NAMELEN  (16)
+
+typedef struct{
+	uint64_t t;        // CLOCK_MONOTONIC, ns
+	int32_t ev, a;
+	int64_t b;
+} trace_rec;
+
+typedef struct{
+	char name[NAMELEN];        // name of thread
+	uint32_t head;             // amount of records written
+	uint32_t reserved[11];
+	trace_rec rec[TRACE_LEN];
+} __attribute__((aligned(64))) trace_ring;
+
+typedef struct{
+	uint32_t magic, nrings, len;
+	uint32_t claimed;          // rings taken by threads
+	trace_ring ring[TRACE_RINGS];
+} trace_area;
+
+static const struct{
+	const char *fmt; // formatted with a (int) & b (long long)
+	int str;         // b is string of a symbols
+} events[TR_NEVENTS] = {
+	[TR_START] = {"child started, pid %d", 0},
+	[TR_CMD] = {"command %.*s", 1},
+	[TR_MOVE] = {"%c move %lld", 0},
+	[TR_STOP] = {"%c stop at %lld", 0},
+	[TR_STOPPED] = {"%c stopped at %lld", 0},
+	[TR_HOMING_FAILED] = {"%c homing failed", 0},
+	[TR_CAPTURE] = {"frame captured, %d bytes", 0},
+	[TR_CAPTURE_ERR] = {"capture error %d", 0},
+	[TR_RECONNECT] = {"reconnection to image server", 0},
+	[TR_SEND_XY] = {"message sent, %d bytes", 0},
+	[TR_SEND_IMAGE] = {"frame sent, %d bytes", 0},
+	[TR_CONNECT] = {"network connection, fd %d", 0},
+	[TR_XY_OPEN] = {"XY session opened", 0},
+	[TR_XY_CLOSE] = {"XY session closed", 0},
+	[TR_IMAGE_OPEN] = {"image session opened", 0},
+	[TR_IMAGE_CLOSE] = {"image session closed", 0},
+	[TR_MSG_DROPPED] = {"message dropped", 0},
+	[TR_SCAN_FRAME] = {"scan frame %d at %lld", 0}
+};
+
+static trace_area *area = NULL;
+static __thread trace_ring *mine = NULL;
+
+/**
+ * Map file of recorder (create & initialize it if it's broken)
+ * @param readonly - !0 to read existing file (dump tool)
+ * @return 0 if all OK
+ */
+int trace_open(const char *path, int readonly){
+	trace_area *t;
+	int fd = open(path, readonly ? O_RDONLY : (O_RDWR | O_CREAT), 0644);
+	if(fd < 0){
+		perror("open()");
+		return 1;
+	}
+	if(!readonly && ftruncate(fd, sizeof(trace_area))){
+		perror("ftruncate()");
+		close(fd);
+		return 1;
+	}
+	t = mmap(NULL, sizeof(trace_area), readonly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+	close(fd);
+	if(t == MAP_FAILED){
+		perror("mmap()");
+		return 1;
+	}
+	if(t->magic != TRACE_MAGIC || t->nrings != TRACE_RINGS || t->len != TRACE_LEN){
+		if(readonly){
+			fprintf(stderr, "%s isn't a trace file\n", path);
+			munmap(t, sizeof(trace_area));
+			return 1;
+		}
+		memset(t, 0, sizeof(trace_area));
+		t->magic = TRACE_MAGIC;
+		t->nrings = TRACE_RINGS;
+		t->len = TRACE_LEN;
+	}
+	area = t;
+	return 0;
+}
+
+/**
+ * Forget all records (supervisor does it before start of child)
+ */
+void trace_reset(){
+	int i;
+	if(!area) return;
+	for(i = 0; i < TRACE_RINGS; ++i){
+		area->ring[i].head = 0;
+		area->ring[i].name[0] = 0;
+	}
+	area->claimed = 0;
+}
+
+/**
+ * Take ring for calling thread; threads with the same name (e.g. threads of
+ * scans, which don't work together) use the same ring
+ */
+void trace_thread(const char *name){
+	uint32_t i, n;
+	if(!area) return;
+	n = __atomic_load_n(&area->claimed, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n && i < TRACE_RINGS; ++i)
+		if(!strncmp(area->ring[i].name, name, NAMELEN)){
+			mine = &area->ring[i];
+			return;
+		}
+	n = __atomic_fetch_add(&area->claimed, 1, __ATOMIC_ACQ_REL);
+	if(n >= TRACE_RINGS) return; // no more rings: events of this thread are lost
+	strncpy(area->ring[n].name, name, NAMELEN - 1);
+	mine = &area->ring[n];
+}
+
+/**
+ * Write event to ring of calling thread
+ */
+void trace(int ev, int32_t a, int64_t b){
+	struct timespec t;
+	trace_rec *r;
+	if(!mine){
+		if(!area) return;
+		trace_thread("thread");
+		if(!mine) return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	r = &mine->rec[mine->head & (TRACE_LEN - 1)];
+	r->t = (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+	r->ev = ev;
+	r->a = a;
+	r->b = b;
+	// record is complete before it's counted
+	__atomic_store_n(&mine->head, mine->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write event with string argument (only 8 first symbols are stored)
+ */
+void trace_str(int ev, const char *s){
+	int64_t b = 0;
+	size_t L = strnlen(s, sizeof(b));
+	memcpy(&b, s, L);
+	trace(ev, (int32_t)L, b);
+}
+
+typedef struct{
+	trace_rec r;
+	int ring;
+} dump_rec;
+
+static int cmprec(const void *a, const void *b){
+	uint64_t ta = ((const dump_rec*)a)->r.t, tb = ((const dump_rec*)b)->r.t;
+	return (ta > tb) - (ta < tb);
+}
+
+/**
+ * Print records of all rings sorted by time
+ * @param last - amount of last records to print (0 - all)
+ */
+void trace_dump(FILE *f, unsigned int last){
+	dump_rec *all;
+	size_t n = 0, i;
+	int k;
+	if(!area) return;
+	if(!(all = malloc(sizeof(dump_rec) * TRACE_RINGS * TRACE_LEN))) return;
+	for(k = 0; k < TRACE_RINGS; ++k){
+		trace_ring *ring = &area->ring[k];
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), j;
+		if(!ring->name[0]) continue;
+		for(j = (head > TRACE_LEN) ? head - TRACE_LEN : 0; j < head; ++j){
+			all[n].r = ring->rec[j & (TRACE_LEN - 1)];
+			all[n++].ring = k;
+		}
+	}
+	qsort(all, n, sizeof(dump_rec), cmprec);
+	i = (last && n > last) ? n - last : 0;
+	if(n) fprintf(f, "Flight recorder: %zu events, time is relative to the last one\n", n - i);
+	for(; i < n; ++i){
+		trace_rec *r = &all[i].r;
+		fprintf(f, "%12.6f %-10s ", -(double)(all[n-1].r.t - r->t) / 1e9, area->ring[all[i].ring].name);
+		if(r->ev < 0 || r->ev >= TR_NEVENTS || !events[r->ev].fmt)
+			fprintf(f, "unknown event %d (%d, %lld)", r->ev, r->a, (long long)r->b);
+		else if(events[r->ev].str)
+			fprintf(f, events[r->ev].fmt, (r->a > 8) ? 8 : r->a, (const char*)&r->b);
+		else
+			fprintf(f, events[r->ev].fmt, r->a, (long long)r->b);
+		fputc('\n', f);
+	}
+	free(all);
+}
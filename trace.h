@@ -0,0 +1,77 @@
+/*
+ * trace.h
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+// shared memory of flight recorder: it's mapped by supervisor & survives death of child
+#ifndef TRACE_FILE
+	#define TRACE_FILE  "/tmp/rasp-spect.trace"
+#endif
+
+#define TRACE_MAGIC   (0x54525331)
+#define TRACE_RINGS   (8)     // one ring per thread
+#define TRACE_LEN     (1024)  // records in ring (power of 2)
+#define TRACE_DUMP_LAST (200) // events printed by supervisor when child dies
+
+// events, arguments a & b are formatted when ring is dumped
+enum{
+	TR_START,          // child started: a - pid
+	TR_CMD,            // command: a - length, b - its first 8 symbols
+	TR_MOVE,           // start of move: a - axis, b - pulses
+	TR_STOP,           // stop by command: a - axis, b - pulses made
+	TR_STOPPED,        // axis stopped: a - axis, b - pulses made
+	TR_HOMING_FAILED,  // a - axis
+	TR_CAPTURE,        // frame captured: a - size
+	TR_CAPTURE_ERR,    // a - TRE_* code
+	TR_RECONNECT,      // new connection to image server
+	TR_SEND_XY,        // message sent: a - size
+	TR_SEND_IMAGE,     // frame sent: a - size
+	TR_CONNECT,        // network connection: a - fd
+	TR_XY_OPEN,        // session of XY-protocol opened / closed
+	TR_XY_CLOSE,
+	TR_IMAGE_OPEN,     // session of image protocol opened / closed
+	TR_IMAGE_CLOSE,
+	TR_MSG_DROPPED,    // message dropped by full queue
+	TR_SCAN_FRAME,     // frame of scan is ready: a - index, b - position
+	TR_NEVENTS
+};
+
+// codes of capture errors
+enum{
+	TRE_CONNECT = 1,   // can't connect to image server
+	TRE_SEND,          // can't send request
+	TRE_TIMEOUT,       // no answer
+	TRE_READ,          // error of reading
+	TRE_CLOSED         // socket closed by server
+};
+
+int trace_open(const char *path, int readonly);
+void trace_reset();
+void trace_thread(const char *name);
+void trace(int ev, int32_t a, int64_t b);
+void trace_str(int ev, const char *s);
+void trace_dump(FILE *f, unsigned int last);
+
+#endif // __TRACE_H__
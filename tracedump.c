@@ -0,0 +1,49 @@
+/*
+ * tracedump.c - print flight recorder of rasp-spect
+ *
+ * Copyright 2016 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+int main(int argc, char **argv){
+	int opt;
+	unsigned int last = 0;
+	const char *path = TRACE_FILE;
+	while((opt = getopt(argc, argv, "n:f:h")) != -1){
+		switch(opt){
+			case 'n':
+				last = (unsigned int)atoi(optarg);
+			break;
+			case 'f':
+				path = optarg;
+			break;
+			default:
+				printf("Usage: %s [-n N] [-f file]\n", argv[0]);
+				printf("\t-n N    - print only N last events\n");
+				printf("\t-f file - trace file (default " TRACE_FILE ")\n");
+				return 1;
+		}
+	}
+	if(trace_open(path, 1)) return 1;
+	trace_dump(stdout, last);
+	return 0;
+}